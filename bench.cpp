@@ -1,5 +1,16 @@
 #include "concurrent_revisions.h"
+#include "util.h"
+#include "versioned_array.h"
+#include "versioned_map.h"
 
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <sys/time.h>
 #include <unistd.h>
 #include <stdarg.h>
@@ -30,6 +41,46 @@ struct __bench__ {
  
 #define bench(...) if(__bench__ __b__ = __bench__(__VA_ARGS__));else
 
+// count heap allocations to report allocations per operation. None of
+// these are inlined, or gcc takes the malloc() or free() it sees for a
+// mismatch with the new or delete it pairs it with.
+static std::atomic<long> allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t n)
+{
+  ++allocations;
+  if (void *p = malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+#endif
+
 using namespace concurrent_revisions;
 using namespace std;
 
@@ -67,10 +118,10 @@ int sequential_fib(int n)
     sequential_fib(n - 2);
 }
 
-void parallel_fib(int n, versioned<int, add_merger<int> > &sum)
+void parallel_fib(int n, cumulative<int> &sum)
 {
   if (n < 40) {
-    sum = sum + sequential_fib(n);
+    sum += sequential_fib(n);
   }
   else {
     revision r1 = fork([&]{ parallel_fib(n - 1, sum); });
@@ -80,13 +131,566 @@ void parallel_fib(int n, versioned<int, add_merger<int> > &sum)
   }
 }
 
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void fork_join_latency(int n)
+{
+  long allocs = allocations;
+  double start = now();
+  bench("fork+join (sequential, %d)", n) {
+    for (int i = 0; i < n; ++i) {
+      revision r = fork([]{});
+      join(r);
+    }
+  }
+  fprintf(stderr, "  %.3f usec / fork+join, %.2f allocations / fork+join\n",
+          (now() - start) * 1e6 / n, double(allocations - allocs) / n);
+
+  allocs = allocations;
+  start = now();
+  bench("fork+join (fan-out 2, %d)", n) {
+    for (int i = 0; i < n; ++i) {
+      revision r1 = fork([]{});
+      revision r2 = fork([]{});
+      join(r1);
+      join(r2);
+    }
+  }
+  fprintf(stderr, "  %.3f usec / fork+join, %.2f allocations / fork+join\n",
+          (now() - start) * 1e6 / (2 * n), double(allocations - allocs) / (2 * n));
+
+  versioned<int, add_merger<int> > sum;
+  allocs = allocations;
+  start = now();
+  bench("fork+join writing a variable (%d)", n) {
+    for (int i = 0; i < n; ++i) {
+      revision r = fork([&]{ sum = sum + 1; });
+      join(r);
+    }
+  }
+  fprintf(stderr, "  %.3f usec / fork+join, %.2f allocations / fork+join\n",
+          (now() - start) * 1e6 / n, double(allocations - allocs) / n);
+}
+
+// short-lived variables: construct, write once in the current segment, drop
+void variable_latency(int n)
+{
+  long allocs = allocations;
+  double start = now();
+  bench("versioned<int> construct+write (%d)", n) {
+    for (int i = 0; i < n; ++i) {
+      versioned<int> x;
+      x = i;
+    }
+  }
+  fprintf(stderr, "  %.3f nsec / variable, %.2f allocations / variable\n",
+          (now() - start) * 1e9 / n, double(allocations - allocs) / n);
+}
+
+// join of a finished revision that wrote n variables of two types, after
+// which the joiner reads one of them
+void join_latency(int total, bool lazy)
+{
+  for (int n = 16; n <= 65536; n *= 4) {
+    vector<versioned<int> > xs(n);
+    vector<versioned<double, add_merger<double> > > ys(n);
+    int reps = max(1, total / n);
+    double elapsed = 0;
+    double check = 0;
+    for (int k = 0; k < reps; ++k) {
+      atomic_bool done(false);
+      revision r = fork([&] {
+          for (int i = 0; i < n; ++i) {
+            xs[i] = k;
+            ys[i] = ys[i] + 1.0;
+          }
+          done = true;
+        });
+      while (!done) this_thread::yield();
+      double start = now();
+      if (lazy)
+        lazy_join(r);
+      else
+        join(r);
+      check += ys[0];
+      elapsed += now() - start;
+    }
+    fprintf(stderr, "%s (%5d + %5d variables): %10.3f usec / join, %.3f nsec / variable (%g)\n",
+            lazy ? "lazy_join" : "join     ", n, n,
+            elapsed * 1e6 / reps, elapsed * 1e9 / reps / (2 * n), check);
+  }
+}
+
+// sum += 1 in parallel leaves, through versioned<> and through cumulative<>
+template <class Sum>
+void increment_leaves(int leaves, int n, Sum &sum, void (*inc)(Sum &))
+{
+  if (leaves == 1) {
+    for (int i = 0; i < n; ++i) inc(sum);
+    return;
+  }
+  revision r = fork([&]{ increment_leaves(leaves / 2, n, sum, inc); });
+  increment_leaves(leaves - leaves / 2, n, sum, inc);
+  join(r);
+}
+
+void increment_versioned(versioned<int64_t, add_merger<int64_t> > &sum)
+{
+  sum = sum + 1;
+}
+
+void increment_cumulative(cumulative<int64_t> &sum)
+{
+  sum += 1;
+}
+
+void increment_latency(int n)
+{
+  const int leaves = 16;
+  double start = now();
+  versioned<int64_t, add_merger<int64_t> > vsum;
+  bench("versioned sum = sum + 1 (%d x %d)", leaves, n) {
+    increment_leaves(leaves, n, vsum, &increment_versioned);
+  }
+  fprintf(stderr, "  %.3f nsec / increment (%lld)\n",
+          (now() - start) * 1e9 / n / leaves, (long long)vsum);
+
+  start = now();
+  cumulative<int64_t> csum;
+  bench("cumulative sum += 1 (%d x %d)", leaves, n) {
+    increment_leaves(leaves, n, csum, &increment_cumulative);
+  }
+  fprintf(stderr, "  %.3f nsec / increment (%lld)\n",
+          (now() - start) * 1e9 / n / leaves, (long long)csum);
+}
+
+// 16 revisions each writing a 1/16 slice of an array of n ints
+void array_write(int n)
+{
+  const int leaves = 16;
+  vector<int> ix(leaves);
+  for (int i = 0; i < leaves; ++i) ix[i] = i;
+
+  {
+    versioned<vector<int> > v;
+    v = vector<int>(n);
+    bench("versioned<vector<int> > (%d)", n) {
+      parallel_foreach(ix.begin(), ix.end(), [&](int k) {
+          vector<int> w = v;
+          for (int i = k * (n / leaves); i < (k + 1) * (n / leaves); ++i)
+            w[i] = i;
+          v = w;
+        }, 1);
+    }
+  }
+
+  {
+    versioned_array<int> a(n);
+    bench("versioned_array<int> (%d)", n) {
+      parallel_foreach(ix.begin(), ix.end(), [&](int k) {
+          for (int i = k * (n / leaves); i < (k + 1) * (n / leaves); ++i)
+            a.set(i, i);
+        }, 1);
+    }
+  }
+}
+
+// 16 revisions each updating 100 keys of a table of n keys
+void map_update(int n)
+{
+  const int leaves = 16;
+  vector<int> ix(leaves);
+  for (int i = 0; i < leaves; ++i) ix[i] = i;
+
+  {
+    versioned<unordered_map<int, int> > m;
+    unordered_map<int, int> init;
+    for (int i = 0; i < n; ++i) init[i] = i;
+    m = init;
+    bench("versioned<unordered_map<int, int> > (%d)", n) {
+      parallel_foreach(ix.begin(), ix.end(), [&](int k) {
+          unordered_map<int, int> w = m;
+          for (int i = 0; i < 100; ++i)
+            w[k * 100 + i] = -i;
+          m = w;
+        }, 1);
+    }
+  }
+
+  {
+    versioned_map<int, int> m;
+    for (int i = 0; i < n; ++i) m.set(i, i);
+    bench("versioned_map<int, int> (%d)", n) {
+      parallel_foreach(ix.begin(), ix.end(), [&](int k) {
+          for (int i = 0; i < 100; ++i)
+            m.set(k * 100 + i, -i);
+        }, 1);
+    }
+  }
+}
+
+// n small modifications of a vector of 100000 ints, one segment per 100
+void update_latency(int n)
+{
+  versioned<vector<int> > v;
+  v = vector<int>(100000);
+  bench("versioned<vector<int> > copy, modify, set (%d)", n) {
+    for (int i = 0; i < n; ++i) {
+      vector<int> w = v;
+      ++w[i % w.size()];
+      v = w;
+      if (i % 100 == 99) join(fork([]{}));
+    }
+  }
+
+  bench("versioned<vector<int> > update (%d)", n) {
+    for (int i = 0; i < n; ++i) {
+      v.update([i](vector<int> &w) { ++w[i % w.size()]; });
+      if (i % 100 == 99) join(fork([]{}));
+    }
+  }
+}
+
+// fan-out to 64 revisions that each add to n shared variables, then join
+// them one by one or with join_all
+void join_all_latency(int n)
+{
+  const int fanout = 64;
+  for (int all = 0; all < 2; ++all) {
+    vector<versioned<int, add_merger<int> > > xs(n);
+    vector<revision> rs;
+    for (int t = 0; t < fanout; ++t)
+      rs.push_back(fork([&] {
+            for (int i = 0; i < n; ++i) xs[i] = xs[i] + 1;
+          }));
+    for (int t = 0; t < fanout; ++t)
+      detail::scheduler::instance().wait(rs[t].ptr());
+    double start = now();
+    if (all) {
+      join_all(rs);
+    } else {
+      for (int t = 0; t < fanout; ++t) join(rs[t]);
+    }
+    fprintf(stderr, "%s (%d x %d variables): %.3f msec (%d)\n",
+            all ? "join_all  " : "join loop ", fanout, n, (now() - start) * 1e3, (int)xs[0]);
+  }
+}
+
+// parallel_stable_sort before it merged in parallel
+template <class Iterator>
+void inplace_merge_sort(Iterator first, Iterator last, size_t min_parallel = 1024)
+{
+  size_t len = last - first;
+  if (len <= min_parallel) {
+    std::stable_sort(first, last);
+  } else {
+    Iterator mid = first + len/2;
+    revision r = fork([&] {
+        inplace_merge_sort(first, mid, min_parallel);
+      });
+    inplace_merge_sort(mid, last, min_parallel);
+    join(r);
+    std::inplace_merge(first, mid, last);
+  }
+}
+
+void sort_throughput(int n)
+{
+  vector<uint32_t> keys(n);
+  uint32_t x = 2463534242u;
+  for (int i = 0; i < n; ++i) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    keys[i] = x;
+  }
+
+  vector<uint32_t> v;
+  auto run = [&](const char *name, void (*sort)(vector<uint32_t>::iterator, vector<uint32_t>::iterator)) {
+    v = keys;
+    double start = now();
+    sort(v.begin(), v.end());
+    double t = now() - start;
+    fprintf(stderr, "%-32s %.3f sec, %.1f Mkeys/sec%s\n", name, t, n / t * 1e-6,
+            std::is_sorted(v.begin(), v.end()) ? "" : " (not sorted)");
+  };
+  typedef vector<uint32_t>::iterator iter;
+  run("std::sort", [](iter p, iter q) { std::sort(p, q); });
+  run("std::stable_sort", [](iter p, iter q) { std::stable_sort(p, q); });
+  run("stable sort with inplace_merge", [](iter p, iter q) { inplace_merge_sort(p, q); });
+  run("parallel_stable_sort", [](iter p, iter q) { parallel_stable_sort(p, q); });
+  run("parallel_sort", [](iter p, iter q) { parallel_sort(p, q); });
+}
+
+void reduce_scan_throughput(int n)
+{
+  vector<int64_t> v(n);
+  for (int i = 0; i < n; ++i)
+    v[i] = i % 1000;
+  vector<int64_t> out(n);
+
+  auto report = [&](const char *name, double start, int64_t check) {
+    double t = now() - start;
+    fprintf(stderr, "%-32s %.3f sec, %.1f Melems/sec (%lld)\n", name, t, n / t * 1e-6, (long long)check);
+  };
+
+  double start = now();
+  int64_t sum = std::accumulate(v.begin(), v.end(), int64_t(0));
+  report("std::accumulate", start, sum);
+
+  start = now();
+  sum = parallel_reduce(v.begin(), v.end(), int64_t(0));
+  report("parallel_reduce", start, sum);
+
+  // what parallel_reduce replaces: a cumulative variable updated per element
+  start = now();
+  cumulative<int64_t> acc;
+  parallel_foreach(v.begin(), v.end(), [&](int64_t x) { acc += x; });
+  report("parallel_foreach + cumulative", start, acc);
+
+  start = now();
+  std::partial_sum(v.begin(), v.end(), out.begin());
+  report("std::partial_sum", start, out.back());
+
+  start = now();
+  parallel_inclusive_scan(v.begin(), v.end(), out.begin());
+  report("parallel_inclusive_scan", start, out.back());
+
+  start = now();
+  parallel_exclusive_scan(v.begin(), v.end(), out.begin(), int64_t(0));
+  report("parallel_exclusive_scan", start, out.back());
+}
+
+// parallel_foreach over cheap and expensive elements with fixed grain
+// sizes and with auto_grain
+void grain_selection(int n)
+{
+  fprintf(stderr, "fork + join: %.0f nsec\n", detail::partitioner::fork_cost());
+
+  vector<uint32_t> v(n);
+  auto cheap = [](uint32_t &x) { x = x * 2654435761u + 1; };
+  // about 10 usec each
+  vector<uint32_t> w(n / 10000);
+  auto expensive = [](uint32_t &x) {
+    for (int i = 0; i < 10000; ++i) x = x * 2654435761u + 1;
+  };
+
+  size_t grains[] = { 1, 1024, 65536, auto_grain };
+  for (size_t i = 0; i < sizeof(grains) / sizeof(grains[0]); ++i) {
+    string name = grains[i] == auto_grain ? string("auto_grain")
+                                          : "min_parallel " + to_string(grains[i]);
+
+    double start = now();
+    if (grains[i] != 1) {
+      parallel_foreach(v.begin(), v.end(), cheap, grains[i]);
+      fprintf(stderr, "%-20s cheap (%d):      %.3f sec\n", name.c_str(), n, now() - start);
+    }
+    start = now();
+    parallel_foreach(w.begin(), w.end(), expensive, grains[i]);
+    fprintf(stderr, "%-20s expensive (%zu): %.3f sec\n", name.c_str(), w.size(), now() - start);
+  }
+}
+
+// searches for a key at 2% of the range and for a missing one
+void find_latency(int n)
+{
+  vector<int> v(n);
+  for (int i = 0; i < n; ++i) v[i] = i;
+
+  int keys[] = { n / 50, -1 };
+  for (int k = 0; k < 2; ++k) {
+    int key = keys[k];
+    auto hit = [key](int x) { return x == key; };
+
+    double start = now();
+    long pos = std::find_if(v.begin(), v.end(), hit) - v.begin();
+    fprintf(stderr, "std::find_if           key %d: %.3f msec (%ld)\n", key, (now() - start) * 1e3, pos);
+
+    start = now();
+    pos = parallel_find_if(v.begin(), v.end(), hit) - v.begin();
+    fprintf(stderr, "parallel_find_if       key %d: %.3f msec (%ld)\n", key, (now() - start) * 1e3, pos);
+
+    // what parallel_find_if replaces: every element is tested
+    start = now();
+    versioned<int, min_merger<int> > first;
+    first = n;
+    vector<int>::iterator base = v.begin();
+    parallel_foreach(v.begin(), v.end(), [&](int &x) {
+        if (hit(x) && (int)(&x - &*base) < (int)first) first = &x - &*base;
+      });
+    fprintf(stderr, "parallel_foreach + min key %d: %.3f msec (%d)\n", key, (now() - start) * 1e3, (int)first);
+  }
+}
+
+// discarding a revision that wrote n variables, by join and by abort
+void abort_latency(int n)
+{
+  vector<versioned<int, add_merger<int> > > xs(n);
+  for (int a = 0; a < 2; ++a) {
+    revision r = fork([&] {
+        for (int i = 0; i < n; ++i) xs[i] = xs[i] + 1;
+      });
+    detail::scheduler::instance().wait(r.ptr());
+    double start = now();
+    if (a)
+      abort(r);
+    else
+      join(r);
+    fprintf(stderr, "%s (%d variables): %.3f msec\n", a ? "abort" : "join ", n, (now() - start) * 1e3);
+  }
+}
+
+// reads of a variable written 16 segments up the current revision's chain
+void read_latency(int n)
+{
+  versioned<int> x;
+  x = 1;
+  vector<revision> rs;
+  for (int i = 0; i < 16; ++i)
+    rs.push_back(fork([]{}));
+
+  int64_t sum = 0;
+  double start = now();
+  bench("read (chain depth 16, %d)", n) {
+    for (int i = 0; i < n; ++i)
+      sum += x;
+  }
+  fprintf(stderr, "  %.3f nsec / read (%lld)\n", (now() - start) * 1e9 / n, (long long)sum);
+
+  for (size_t i = 0; i < rs.size(); ++i)
+    join(rs[i]);
+}
+
+// Each thread behaves like a revision using one shared variable: it walks
+// a chain of ancestor versions (misses), reads the value at the top and
+// writes its own version. Every 64 iterations it moves on to a new version,
+// which erases the old one and inserts a new one.
+template <class Map>
+double intmap_contention(int threads, int total)
+{
+  const int depth = 8;
+  const int iters = total / threads;
+  Map m;
+  m.set(0, 0);
+
+  double start = now();
+  vector<thread> ts;
+  for (int t = 0; t < threads; ++t) {
+    ts.push_back(thread([&m, t, threads, iters]{
+          int own = 1 + t;
+          for (int i = 0; i < iters; ++i) {
+            if (i % 64 == 63) {
+              m.erase(own);
+              own += threads;
+            }
+            int sum = 0;
+            for (int d = 0; d < depth; ++d)
+              sum += m.has(-(own * depth + d) - 10);
+            m.set(own, sum + m.get(0));
+          }
+        }));
+  }
+  for (size_t i = 0; i < ts.size(); ++i)
+    ts[i].join();
+  return total / (now() - start);
+}
+
+void intmap_contention(int total)
+{
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    double locked = intmap_contention<locked_intmap<int> >(threads, total);
+    double lockfree = intmap_contention<concurrent_intmap<int> >(threads, total);
+    fprintf(stderr, "intmap %2d threads: locked %8.3f Mops/s, lock-free %8.3f Mops/s\n",
+            threads, locked * 1e-6, lockfree * 1e-6);
+  }
+}
+
 int main(int argc, char *argv[])
 {
   if (argc <= 1)
     return 1;
 
+  if (strcmp(argv[1], "forkjoin") == 0) {
+    fork_join_latency(argc > 2 ? atoi(argv[2]) : 100000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "join") == 0) {
+    join_latency(argc > 2 ? atoi(argv[2]) : 1 << 22, false);
+    join_latency(argc > 2 ? atoi(argv[2]) : 1 << 22, true);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "variable") == 0) {
+    variable_latency(argc > 2 ? atoi(argv[2]) : 10000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "increment") == 0) {
+    increment_latency(argc > 2 ? atoi(argv[2]) : 10000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "array") == 0) {
+    array_write(argc > 2 ? atoi(argv[2]) : 1 << 20);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "map") == 0) {
+    map_update(argc > 2 ? atoi(argv[2]) : 1000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "update") == 0) {
+    update_latency(argc > 2 ? atoi(argv[2]) : 10000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "joinall") == 0) {
+    join_all_latency(argc > 2 ? atoi(argv[2]) : 4096);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "sort") == 0) {
+    sort_throughput(argc > 2 ? atoi(argv[2]) : 100000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "reduce") == 0) {
+    reduce_scan_throughput(argc > 2 ? atoi(argv[2]) : 100000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "grain") == 0) {
+    grain_selection(argc > 2 ? atoi(argv[2]) : 100000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "find") == 0) {
+    find_latency(argc > 2 ? atoi(argv[2]) : 100000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "abort") == 0) {
+    abort_latency(argc > 2 ? atoi(argv[2]) : 1000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "read") == 0) {
+    read_latency(argc > 2 ? atoi(argv[2]) : 10000000);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "intmap") == 0) {
+    intmap_contention(argc > 2 ? atoi(argv[2]) : 1 << 21);
+    return 0;
+  }
+
   bench("par") {
-    versioned<int, add_merger<int> > sum;
+    cumulative<int> sum;
     parallel_fib(atoi(argv[1]), sum);
     cout << (int)sum << endl;
   }
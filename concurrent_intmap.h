@@ -1,30 +1,305 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <thread>
+#include <vector>
+
+#include "epoch.h"
+#include "object_pool.h"
+#include "spinlock.h"
+#include "stats.h"
 
 namespace concurrent_revisions {
 
+// Segment versions count up from 0. They are 64 bits wide so that they
+// never wrap around to the negative values maps keep for empty slots.
+typedef int64_t version_t;
+
+// Map from segment versions to values. Keys must not be negative.
+//
+// Open-addressed table of atomic slots. Lookups never take a lock, and
+// overwriting the value of an existing version through set() is done in
+// place without a lock. Inserting a new version or erasing one takes a
+// per-map spinlock so that writers can't race a resize.
+//
+// A version is only ever written by the revision whose current segment it
+// belongs to, and it is only erased once nobody can read it any more, so
+// values can be updated and deleted without synchronizing with readers of
+// the same version. Tables replaced by a resize are reclaimed through
+// detail::epoch, as readers may still be probing them.
+//
+// The map also counts references from outside (the owning variable's
+// handles), so that the owner can tell when neither versions nor handles
+// are left.
 template <class V>
 class concurrent_intmap {
 public:
-  const bool has(int ix) const {
+  concurrent_intmap()
+    : table_(nullptr)
+    , refs_(0)
+    , used_(0)
+    , live_(0) {
+  }
+
+  ~concurrent_intmap() {
+    table *t = table_.load(std::memory_order_relaxed);
+    for (size_t i = 0; t && i < t->capacity; ++i) {
+      cell *c = t->slots[i].val.load(std::memory_order_relaxed);
+      if (c) free_cell(c);
+    }
+    delete t;
+  }
+
+  const bool has(version_t ix) const {
+    return find_cell(ix) != nullptr;
+  }
+
+  const V &get(version_t ix) const {
+    return find_cell(ix)->value();
+  }
+
+  // nullptr if ix is not in the map
+  const V *find(version_t ix) const {
+    cell *c = find_cell(ix);
+    return c ? &c->value() : nullptr;
+  }
+
+  // for the owner of ix, e.g. to move its value out before erasing it
+  V *find(version_t ix) {
+    cell *c = find_cell(ix);
+    return c ? &c->value() : nullptr;
+  }
+
+  // returns the stored value, which stays at the same address until ix is
+  // erased
+  template <class U>
+  const V &set(version_t ix, U &&v) {
+    cell *c = find_cell(ix);
+    if (c) {
+      c->value() = std::forward<U>(v);
+      return c->value();
+    }
+    bool inserted;
+    return insert_or_assign(ix, std::forward<U>(v), inserted);
+  }
+
+  // set() with a single probe under the lock, for writers that expect ix
+  // to be new
+  template <class U>
+  const V &insert_or_assign(version_t ix, U &&v, bool &inserted) {
+    std::lock_guard<detail::spinlock> lk(m_);
+    table *t = table_.load(std::memory_order_relaxed);
+    slot *s = t ? t->probe(ix) : nullptr;
+    inserted = !s;
+    if (s) {
+      cell *c = s->val.load(std::memory_order_relaxed);
+      c->value() = std::forward<U>(v);
+      return c->value();
+    }
+    cell *c = new_cell(std::forward<U>(v));
+    insert(ix, c);
+    detail::count(detail::stat_versions_created);
+    return c->value();
+  }
+
+  // returns true if no versions and no references are left
+  bool erase(version_t ix) {
+    std::lock_guard<detail::spinlock> lk(m_);
+    table *t = table_.load(std::memory_order_relaxed);
+    slot *s = t ? t->probe(ix) : nullptr;
+    if (s) {
+      cell *c = s->val.load(std::memory_order_relaxed);
+      s->val.store(nullptr, std::memory_order_relaxed);
+      s->key.store(tombstone, std::memory_order_release);
+      --live_;
+      free_cell(c);
+      detail::count(detail::stat_versions_erased);
+    }
+    return live_ == 0 && refs_.load(std::memory_order_relaxed) == 0;
+  }
+
+  void retain() {
+    std::lock_guard<detail::spinlock> lk(m_);
+    refs_.store(refs_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  // returns true if no versions and no references are left
+  bool release() {
+    std::lock_guard<detail::spinlock> lk(m_);
+    int refs = refs_.load(std::memory_order_relaxed) - 1;
+    refs_.store(refs, std::memory_order_release);
+    return live_ == 0 && refs == 0;
+  }
+
+  int refs() const {
+    return refs_.load(std::memory_order_acquire);
+  }
+
+  // prepares an unused, empty map for reuse; nobody else may access it
+  void reset(int refs) {
+    table *t = table_.load(std::memory_order_relaxed);
+    for (size_t i = 0; t && i < t->capacity; ++i)
+      t->slots[i].key.store(empty, std::memory_order_relaxed);
+    used_ = 0;
+    refs_.store(refs, std::memory_order_relaxed);
+  }
+
+  void dump() {
+    std::lock_guard<detail::spinlock> lk(m_);
+    std::cout << "vvvvv" << std::endl;
+    table *t = table_.load(std::memory_order_relaxed);
+    for (size_t i = 0; t && i < t->capacity; ++i) {
+      version_t k = t->slots[i].key.load(std::memory_order_relaxed);
+      if (k != empty && k != tombstone)
+        std::cout << k << ": " << t->slots[i].val.load()->value() << std::endl;
+    }
+    std::cout << "^^^^^" << std::endl;
+  }
+
+private:
+  static const version_t empty = -1;
+  static const version_t tombstone = -2;
+
+  // pooled storage for one value
+  struct cell : public detail::pooled<cell> {
+    V &value() {
+      return *reinterpret_cast<V*>(&storage);
+    }
+    typename std::aligned_storage<sizeof(V), std::alignment_of<V>::value>::type storage;
+  };
+
+  template <class U>
+  static cell *new_cell(U &&v) {
+    cell *c = detail::object_pool<cell>::acquire();
+    new (&c->storage) V(std::forward<U>(v));
+    return c;
+  }
+
+  static void free_cell(cell *c) {
+    c->value().~V();
+    detail::object_pool<cell>::recycle(c);
+  }
+
+  struct slot {
+    slot() : key(empty), val(nullptr) {}
+    std::atomic<version_t> key;
+    std::atomic<cell*> val;
+  };
+
+  struct table {
+    explicit table(size_t cap)
+      : capacity(cap)
+      , slots(new slot[cap]) {
+    }
+    ~table() {
+      delete[] slots;
+    }
+
+    static size_t hash(version_t ix) {
+      return (size_t)((uint64_t)ix * 0x9e3779b97f4a7c15ull);
+    }
+
+    slot *probe(version_t ix) const {
+      size_t mask = capacity - 1;
+      for (size_t i = 0, h = hash(ix) & mask; i < capacity; ++i, h = (h + 1) & mask) {
+        version_t k = slots[h].key.load(std::memory_order_acquire);
+        if (k == ix) return &slots[h];
+        if (k == empty) return nullptr;
+      }
+      return nullptr;
+    }
+
+    size_t capacity;
+    slot *slots;
+  };
+
+  cell *find_cell(version_t ix) const {
+    detail::count(detail::stat_intmap_lookups);
+    detail::epoch::guard g;
+    table *t = table_.load(std::memory_order_seq_cst);
+    if (!t) return nullptr;
+    slot *s = t->probe(ix);
+    return s ? s->val.load(std::memory_order_acquire) : nullptr;
+  }
+
+  // requires m_
+  void insert(version_t ix, cell *c) {
+    table *t = table_.load(std::memory_order_relaxed);
+    if (!t || (used_ + 1) * 4 > t->capacity * 3)
+      t = rehash(t);
+
+    size_t mask = t->capacity - 1;
+    for (size_t h = table::hash(ix) & mask; ; h = (h + 1) & mask) {
+      version_t k = t->slots[h].key.load(std::memory_order_relaxed);
+      if (k == empty || k == tombstone) {
+        if (k == empty) ++used_;
+        ++live_;
+        t->slots[h].val.store(c, std::memory_order_relaxed);
+        t->slots[h].key.store(ix, std::memory_order_release);
+        return;
+      }
+    }
+  }
+
+  // requires m_
+  table *rehash(table *old) {
+    size_t cap = 8;
+    while (cap < (live_ + 1) * 2) cap *= 2;
+
+    table *t = new table(cap);
+    used_ = 0;
+    for (size_t i = 0; old && i < old->capacity; ++i) {
+      version_t k = old->slots[i].key.load(std::memory_order_relaxed);
+      if (k == empty || k == tombstone) continue;
+      size_t mask = cap - 1;
+      size_t h = table::hash(k) & mask;
+      while (t->slots[h].key.load(std::memory_order_relaxed) != empty)
+        h = (h + 1) & mask;
+      t->slots[h].val.store(old->slots[i].val.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      t->slots[h].key.store(k, std::memory_order_relaxed);
+      ++used_;
+    }
+    table_.store(t, std::memory_order_seq_cst);
+    if (old) detail::epoch::retire(old);
+    return t;
+  }
+
+  std::atomic<table*> table_;
+  std::atomic_int refs_;
+  size_t used_;
+  size_t live_;
+  mutable detail::spinlock m_;
+};
+
+// The previous implementation, a mutex around std::unordered_map.
+// Kept as a baseline for benchmarks.
+template <class V>
+class locked_intmap {
+public:
+  const bool has(version_t ix) const {
     std::lock_guard<std::mutex> lk(m_);
     return dat_.count(ix) != 0;
   }
 
-  const V &get(int ix) const {
+  const V &get(version_t ix) const {
     std::lock_guard<std::mutex> lk(m_);
     return dat_.find(ix)->second;
   }
 
-  void set(int ix, const V &v) {
+  void set(version_t ix, const V &v) {
     std::lock_guard<std::mutex> lk(m_);
-    auto pib = dat_.insert(make_pair(ix, v));
+    auto pib = dat_.insert(std::make_pair(ix, v));
     if (!pib.second) pib.first->second = v;
   }
 
-  void erase(int ix) {
+  void erase(version_t ix) {
     std::lock_guard<std::mutex> lk(m_);
     dat_.erase(ix);
   }
@@ -38,7 +313,7 @@ public:
   }
 
 private:
-  std::unordered_map<int, V> dat_;
+  std::unordered_map<version_t, V> dat_;
   mutable std::mutex m_;
 };
 
@@ -1,18 +1,32 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
-#include <functional>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
-#include <thread>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "concurrent_intmap.h"
+#include "object_pool.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "trace.h"
 
 namespace concurrent_revisions {
 
 class segment;
 class revision_impl;
 template <class T, class Merge> class versioned;
+template <class T, class Merge> class cumulative;
 
 template <class T>
 class default_merger {
@@ -28,6 +42,10 @@ public:
   T operator()(const T &main, const T &join, const T &root) const {
     return main + join - root;
   }
+
+  void combine(T &acc, const T &v) const {
+    acc += v;
+  }
 };
 
 template <class T>
@@ -36,6 +54,10 @@ public:
   const T &operator()(const T &main, const T &join, const T &root) const {
     return std::max(main, join);
   }
+
+  void combine(T &acc, const T &v) const {
+    if (acc < v) acc = v;
+  }
 };
 
 template <class T>
@@ -44,6 +66,10 @@ public:
   const T &operator()(const T &main, const T &join, const T &root) const {
     return std::min(main, join);
   }
+
+  void combine(T &acc, const T &v) const {
+    if (v < acc) acc = v;
+  }
 };
 
 template <class Iterator>
@@ -68,33 +94,192 @@ public:
   }
 };
 
+namespace detail_ {
+template <typename = void>
+class uid_ {
+public:
+  static std::atomic<uint64_t> next_block_;
+  static __thread uint64_t next_;
+  static __thread uint64_t end_;
+};
+
+template <typename T>
+std::atomic<uint64_t> uid_<T>::next_block_(1);
+
+template <typename T>
+__thread uint64_t uid_<T>::next_ = 0;
+
+template <typename T>
+__thread uint64_t uid_<T>::end_ = 0;
+
+template <typename = void>
+class read_cache_ {
+public:
+  struct entry {
+    uint64_t tag;
+    uint64_t uid;
+    const void *value;
+    version_t version;
+  };
+
+  static const size_t size = 64;
+  static __thread entry entries_[size];
+};
+
+template <typename T>
+__thread typename read_cache_<T>::entry read_cache_<T>::entries_[read_cache_<T>::size];
+} // namespace detail_
+
 namespace detail {
 
-class versioned_any {
+// process-wide unique non-zero id; threads take ids in blocks so this
+// is usually not an atomic operation
+inline uint64_t next_uid()
+{
+  typedef detail_::uid_<> u;
+  if (u::next_ == u::end_) {
+    u::next_ = u::next_block_.fetch_add(1024);
+    u::end_ = u::next_ + 1024;
+  }
+  return u::next_++;
+}
+
+// Per-thread cache from variables to the value a revision resolved them to
+// and the version it was found in. Entries are tagged with the revision's
+// cache tag, so invalidating all entries of a revision is just taking a new
+// tag.
+class read_cache : public detail_::read_cache_<> {
+public:
+  static const entry *find(uint64_t tag, uint64_t uid) {
+    const entry &e = entries_[uid % size];
+    if (e.tag == tag && e.uid == uid)
+      return &e;
+    return nullptr;
+  }
+
+  static void put(uint64_t tag, uint64_t uid, const void *value, version_t version) {
+    entry &e = entries_[uid % size];
+    e.tag = tag;
+    e.uid = uid;
+    e.value = value;
+    e.version = version;
+  }
+};
+
+// merges and collapses of at least this many written variables per thread
+// are split among worker threads
+static const size_t parallel_merge_grain = 4096;
+
+// What a merge of one joined segment writes to. Variables are split into
+// parts by uid so that several threads can merge disjoint variables.
+struct merge_context {
+  revision_impl *main;
+  revision_impl *join_rev;
+  segment *join;
+  // index of join_rev in main's pending joins
+  size_t index;
+  // receives the variables the merge writes for the first time in main's
+  // current segment
+  segment *written;
+  size_t part;
+  size_t parts;
+  // summarize: the summary segment
+  segment *into;
+};
+
+// The variables of one type written in a segment.
+//
+// A segment keeps one write set per variable type, so release, collapse
+// and merge dispatch once per type and then run a plain loop over the
+// variables.
+class write_set_any {
 public:
-  virtual ~versioned_any() {};
+  explicit write_set_any(const void *type)
+    : type_(type) {}
+  virtual ~write_set_any() {}
+
   virtual void release(segment &s) = 0;
-  virtual void collapse(revision_impl &main, segment &parent) = 0;
-  virtual void merge(revision_impl &main, revision_impl &join_rev, segment &join) = 0;
-  virtual std::shared_ptr<versioned_any> ptr() = 0;
+  // c.join is the collapsed parent
+  virtual void collapse(const merge_context &c) = 0;
+  virtual void merge(const merge_context &c) = 0;
+  // c.join is a segment of the run c.into summarizes
+  virtual void summarize(const merge_context &c) = 0;
+  // adds the variables to s's write set
+  virtual void move_to(segment &s) = 0;
+  // drops dead variables, returns the number of variables left
+  virtual size_t sweep(segment &s) = 0;
+  // empties the set and returns it to its pool
+  virtual void recycle() = 0;
+
+  const void *type_;
 };
 
+template <class V>
+class write_set : public write_set_any, public pooled<write_set<V> > {
+public:
+  write_set()
+    : write_set_any(&tag) {}
+
+  void release(segment &s);
+  void collapse(const merge_context &c);
+  void merge(const merge_context &c);
+  void summarize(const merge_context &c);
+  void move_to(segment &s);
+  size_t sweep(segment &s);
+  void recycle();
+
+  // identifies the type of the set
+  static const char tag;
+
+  std::vector<V*> vars_;
+};
+
+template <class V>
+const char write_set<V>::tag = 0;
+
 } // namespace detail
 
+// The state of a versioned variable.
+//
+// It is referenced by the variable's handles (versioned<>) and by the write
+// sets of the segments holding one of its versions. Both are counted by the
+// version map, and the object goes back to its pool once neither is left.
+// The value of the variable in segments above its first write is stored in
+// place in base_.
 template <class T, class Merge>
-class versioned_val : public detail::versioned_any {
+class versioned_val : public detail::pooled<versioned_val<T, Merge> > {
 public:
   versioned_val();
 
-  const T &get() const;
+  // a new variable with one handle
+  static versioned_val *create();
+
+  void add_handle();
+  void drop_handle();
+
+  // applies the pending merges of the current revision first
+  const T &get();
   void set(const T &v);
+  void set(T &&v);
+  // the value of the current segment's version, which only the current
+  // revision can see; creates the version if needed
+  T &local();
 
   void release(segment &s);
-  void collapse(revision_impl &main, segment &parent);
-  void merge(revision_impl &main, revision_impl &join_rev, segment &join);
+  void collapse(const detail::merge_context &c);
+  void merge(const detail::merge_context &c);
+  void summarize(const detail::merge_context &c);
 
-  std::shared_ptr<detail::versioned_any> ptr() {
-    return q_.lock();
+  uint64_t uid() const {
+    return uid_;
+  }
+
+  // names the variable in profile_report()
+  void name(const char *n);
+
+  // no versioned<> refers to this variable any more
+  bool dead() const {
+    return versions_.refs() == 0;
   }
 
   void dump() {
@@ -104,22 +289,51 @@ public:
 private:
   const T &get(revision_impl &r) const;
   const T &get(segment &r) const;
-  void set(revision_impl &r, const T & v);
-
-  std::weak_ptr<versioned_val<T, Merge> > q_;
+  const T &get(segment &r, version_t &version) const;
+  // true if a new version was created
+  template <class U>
+  bool set(revision_impl &r, U &&v);
+  template <class U>
+  bool set(revision_impl &r, U &&v, segment &written);
+  template <class U>
+  void assign(U &&v);
+
+  void resolve(revision_impl &r);
+  void destroy();
+
+  // counts a merge of join_rev into main for the profiler
+  void profile_merge(revision_impl &main, revision_impl &join_rev);
+
+  uint64_t uid_;
+  T base_;
   concurrent_intmap<T> versions_;
   Merge mf_;
+#ifdef CONCURRENT_REVISIONS_PROFILE
+  std::atomic<detail::var_profile*> profile_;
+
+  detail::var_profile *profile();
+#endif
 
   friend class versioned<T, Merge>;
+  template <class U, class M> friend class cumulative;
 };
 
 template <class T, class Merge = default_merger<T> >
 class versioned {
 public:
   versioned()
-    : p_ (std::make_shared<versioned_val<T, Merge> >()) {
-    p_->q_ = p_;
-    p_->set(T());
+    : p_(versioned_val<T, Merge>::create()) {
+  }
+
+  versioned(const versioned &r)
+    : p_(r.p_) {
+    p_->add_handle();
+  }
+
+  // the variable's versions are dropped as the segments holding them are
+  // released, collapsed or swept
+  ~versioned() {
+    p_->drop_handle();
   }
 
   versioned &operator=(const versioned &r) {
@@ -132,6 +346,26 @@ public:
     return *this;
   }
 
+  versioned &operator=(T &&v) {
+    p_->set(std::move(v));
+    return *this;
+  }
+
+  // constructs the new value from args and moves it in
+  template <class... Args>
+  void emplace(Args&&... args) {
+    p_->set(T(std::forward<Args>(args)...));
+  }
+
+  // calls f(T&) on this revision's own copy of the value, copying it only
+  // on the first write in a segment
+  template <class F>
+  void update(F f) {
+    f(p_->local());
+  }
+
+  // the reference stays valid until this revision next writes, forks or
+  // joins
   operator const T&() const {
     return p_->get();
   }
@@ -139,35 +373,168 @@ public:
   void dump() {
     p_->dump();
   }
+
+  // names the variable in profile_report(), e.g. by CONCURRENT_REVISIONS_HERE
+  void name(const char *n) {
+    p_->name(n);
+  }
   
-  std::shared_ptr<versioned_val<T, Merge> > p_;
+  versioned_val<T, Merge> *p_;
+};
+
+// A versioned variable that is only combined into, e.g. a sum.
+//
+// Merge is add_merger, max_merger or min_merger, and gives both the join
+// semantics and the operation combine() applies. Within a segment the
+// variable is accumulated in place in the revision's own version, so after
+// the first update in a segment an update is a plain operation on memory,
+// without reading the chain or taking the version map's lock.
+template <class T, class Merge = add_merger<T> >
+class cumulative {
+public:
+  cumulative() {}
+
+  cumulative &operator=(const T &v) {
+    v_ = v;
+    return *this;
+  }
+
+  cumulative &operator+=(const T &v) {
+    combine(v);
+    return *this;
+  }
+
+  void combine(const T &v) {
+    v_.p_->mf_.combine(v_.p_->local(), v);
+  }
+
+  operator const T&() const {
+    return v_;
+  }
+
+  void name(const char *n) {
+    v_.name(n);
+  }
+
+private:
+  versioned<T, Merge> v_;
 };
 
 namespace detail_ {
 template <typename = void>
 class segment_ {
 public:
-  static std::atomic_int version_count_;
+  static std::atomic<version_t> version_count_;
 };
 
 template <typename T>
-std::atomic_int segment_<T>::version_count_;
+std::atomic<version_t> segment_<T>::version_count_;
 } // namespace detail_
 
-class segment : public detail_::segment_<> {
+class segment : public detail_::segment_<>, public detail::pooled<segment> {
 public:
-  explicit segment(segment *parent);
+  segment();
+
+  static segment *create(segment *parent);
 
   void release();
   void collapse(revision_impl &main);
 
+  template <class V>
+  void add_written(V *v);
+
+  // parent_ for readers in other revisions, which may see it relinked by
+  // revision_impl::compact()
+  segment *parent() const {
+    return __atomic_load_n(&parent_, __ATOMIC_ACQUIRE);
+  }
+
   //private:
-  std::atomic_int version_;
+  void sweep();
+  void clear_written();
+
+  std::atomic<version_t> version_;
   std::atomic_int refcount_;
   segment *parent_;
-  std::vector<std::shared_ptr<detail::versioned_any> > written_;
+  // the run of segments a summary replaced, kept while other revisions may
+  // still read them
+  segment *absorbed_;
+  // one write set per variable type
+  std::vector<detail::write_set_any*> written_;
+  size_t written_count_;
+  size_t sweep_at_;
 };
 
+namespace detail {
+
+// type-erased void() function object, stored inline when it is small
+class small_function {
+public:
+  small_function()
+    : invoke_(nullptr)
+    , destroy_(nullptr) {
+  }
+
+  ~small_function() {
+    reset();
+  }
+
+  template <class F>
+  void assign(F f) {
+    reset();
+    if (sizeof(F) <= sizeof(buf_) && std::alignment_of<F>::value <= std::alignment_of<buf_type>::value) {
+      new (&buf_) F(std::move(f));
+      invoke_ = &invoke_inline<F>;
+      destroy_ = &destroy_inline<F>;
+    } else {
+      *reinterpret_cast<F**>(&buf_) = new F(std::move(f));
+      invoke_ = &invoke_heap<F>;
+      destroy_ = &destroy_heap<F>;
+    }
+  }
+
+  void operator()() {
+    invoke_(&buf_);
+  }
+
+  void reset() {
+    if (destroy_) destroy_(&buf_);
+    invoke_ = nullptr;
+    destroy_ = nullptr;
+  }
+
+private:
+  small_function(const small_function &);
+  small_function &operator=(const small_function &);
+
+  template <class F>
+  static void invoke_inline(void *p) {
+    (*static_cast<F*>(p))();
+  }
+
+  template <class F>
+  static void destroy_inline(void *p) {
+    static_cast<F*>(p)->~F();
+  }
+
+  template <class F>
+  static void invoke_heap(void *p) {
+    (**static_cast<F**>(p))();
+  }
+
+  template <class F>
+  static void destroy_heap(void *p) {
+    delete *static_cast<F**>(p);
+  }
+
+  typedef std::aligned_storage<64, std::alignment_of<std::max_align_t>::value>::type buf_type;
+  buf_type buf_;
+  void (*invoke_)(void*);
+  void (*destroy_)(void*);
+};
+
+} // namespace detail
+
 namespace detail_ {
 template <typename = void>
 class revision_impl_ {
@@ -179,38 +546,300 @@ template <typename T>
 __thread revision_impl* revision_impl_<T>::current_revision = nullptr;
 } // namespace detail_
 
-class revision_impl : public detail_::revision_impl_<> {
+class revision_impl
+  : public detail_::revision_impl_<>
+  , public detail::task
+  , public detail::pooled<revision_impl> {
 public:
-  revision_impl(segment *root, segment *current);
+  revision_impl();
+
+  static revision_impl *create(segment *root, segment *current);
 
   template <class F>
   revision_impl *fork(F action);
 
   void join(revision_impl *r);
+  void lazy_join(revision_impl *r);
+  void abort(revision_impl *r);
+  // asks r to stop; abort(r) must still follow
+  void cancel(revision_impl *r);
+  void merge_pending();
+  // merges the variables of one part, recording new versions in written
+  void merge_part(segment &written, size_t part, size_t parts);
+  // folds the segments no other revision reads any more into current_,
+  // and every compact_at_ forks also compacts the rest of the chain
+  void collapse();
+  void compact();
+
+  void execute();
+  void destroy();
+
+  void invalidate_cache() {
+    cache_tag_ = detail::next_uid();
+  }
+
+  // number of pending joins already applied to the variable uid
+  size_t resolved(uint64_t uid) const;
+  void mark_resolved(uint64_t uid);
+
+  // bounds the joined revisions kept alive by pending merges
+  static const size_t pending_limit = 64;
+  // forks between compactions of a short chain
+  static const size_t min_compact_at = 16;
 
   //private:
   segment *root_;
   segment *current_;
-  std::unique_ptr<std::thread> thread_;
+  uint64_t cache_tag_;
+  detail::small_function action_;
+  // set when the joiner aborts this revision
+  std::atomic<bool> cancelled_;
+  size_t forks_since_compact_;
+  size_t compact_at_;
+
+  // Joined revisions whose writes are not merged yet, in join order. Each
+  // one keeps its segments alive until merge_pending() runs.
+  std::vector<revision_impl*> pending_;
+  // uid -> n: the first n pending joins are applied to the variable uid.
+  // Reads add to it and never merge, since merge_pending() moves values
+  // that references handed out may point to.
+  std::unordered_map<uint64_t, size_t> resolved_;
+};
+
+namespace detail {
+
+// releases the segments of an aborted revision on a worker thread
+class release_task : public task {
+public:
+  explicit release_task(segment *s)
+    : s_(s) {}
+
+  void execute() {
+    s_->release();
+  }
+
+private:
+  segment *s_;
+};
+
+// runs one part of a split merge or collapse on a worker thread
+template <class F>
+class part_task : public task {
+public:
+  part_task(F &f, size_t part, size_t parts)
+    : f_(f)
+    , written_(object_pool<segment>::acquire())
+    , part_(part)
+    , parts_(parts) {
+  }
+
+  ~part_task() {
+    written_->clear_written();
+    object_pool<segment>::recycle(written_);
+  }
+
+  void execute() {
+    f_(*written_, part_, parts_);
+  }
+
+  F &f_;
+  // new versions of the joiner's current segment, added to it afterwards
+  segment *written_;
+  size_t part_;
+  size_t parts_;
 };
 
+// Calls f(written, part, parts) for each part of a merge or collapse over
+// the given number of write-set entries. Small ones run here as a single
+// part writing to current; larger ones are split among the worker threads
+// so that each part has at least parallel_merge_grain entries.
+template <class F>
+inline void run_parts(segment &current, size_t entries, F f)
+{
+  scheduler &sched = scheduler::instance();
+  size_t parts = std::min(sched.size(), entries / parallel_merge_grain);
+  if (parts <= 1) {
+    f(current, 0, 1);
+    return;
+  }
+
+  std::vector<part_task<F>*> tasks;
+  for (size_t i = 1; i < parts; ++i) {
+    tasks.push_back(new part_task<F>(f, i, parts));
+    sched.spawn(tasks.back());
+  }
+  f(current, 0, parts);
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    sched.wait(tasks[i]);
+    segment &w = *tasks[i]->written_;
+    for (size_t j = 0; j < w.written_.size(); ++j)
+      w.written_[j]->move_to(current);
+    tasks[i]->release();
+  }
+}
+
+} // namespace detail
+
 // implementation
 
 template <class T, class Merge>
 inline versioned_val<T, Merge>::versioned_val()
+  : uid_(0)
+  , base_()
+{
+#ifdef CONCURRENT_REVISIONS_PROFILE
+  profile_.store(nullptr, std::memory_order_relaxed);
+#endif
+}
+
+template <class T, class Merge>
+inline versioned_val<T, Merge> *versioned_val<T, Merge>::create()
+{
+  versioned_val *p = detail::object_pool<versioned_val>::acquire();
+  p->uid_ = detail::next_uid();
+  p->versions_.reset(1);
+#ifdef CONCURRENT_REVISIONS_PROFILE
+  p->profile_.store(nullptr, std::memory_order_relaxed);
+#endif
+  return p;
+}
+
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::name(const char *n)
+{
+#ifdef CONCURRENT_REVISIONS_PROFILE
+  profile_.store(detail::profile_registry::instance().add(n), std::memory_order_release);
+#endif
+}
+
+#ifdef CONCURRENT_REVISIONS_PROFILE
+template <class T, class Merge>
+inline detail::var_profile *versioned_val<T, Merge>::profile()
+{
+  detail::var_profile *p = profile_.load(std::memory_order_acquire);
+  if (p) return p;
+  p = detail::profile_registry::instance().add(typeid(versioned<T, Merge>));
+  detail::var_profile *expected = nullptr;
+  if (!profile_.compare_exchange_strong(expected, p, std::memory_order_acq_rel)) {
+    // another thread counted the variable first
+    p->variables_.fetch_sub(1, std::memory_order_relaxed);
+    p = expected;
+  }
+  return p;
+}
+#endif
+
+// A merge conflicts if the joiner wrote the variable after join_rev forked,
+// so that it no longer sees the version join_rev started from.
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::profile_merge(revision_impl &main, revision_impl &join_rev)
+{
+#ifdef CONCURRENT_REVISIONS_PROFILE
+  detail::var_profile *p = profile();
+  p->merges_.fetch_add(1, std::memory_order_relaxed);
+  version_t main_version, root_version;
+  get(*main.current_, main_version);
+  get(*join_rev.root_, root_version);
+  if (main_version != root_version) {
+    p->conflicts_.fetch_add(1, std::memory_order_relaxed);
+    if (std::is_same<Merge, default_merger<T> >::value)
+      p->discarded_.fetch_add(1, std::memory_order_relaxed);
+  }
+#endif
+}
+
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::add_handle()
+{
+  versions_.retain();
+}
+
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::drop_handle()
+{
+  if (versions_.release())
+    destroy();
+}
+
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::destroy()
 {
+  base_ = T();
+  detail::object_pool<versioned_val>::recycle(this);
 }
 
 template <class T, class Merge>
-inline const T &versioned_val<T, Merge>::get() const
+inline const T &versioned_val<T, Merge>::get()
 {
-  return get(*revision_impl::current_revision);
+  revision_impl &r = *revision_impl::current_revision;
+  const detail::read_cache::entry *e = detail::read_cache::find(r.cache_tag_, uid_);
+  if (e) return *static_cast<const T*>(e->value);
+
+  if (!r.pending_.empty())
+    resolve(r);
+
+  version_t version;
+  const T &v = get(*r.current_, version);
+  detail::read_cache::put(r.cache_tag_, uid_, &v, version);
+  return v;
 }
 
 template <class T, class Merge>
 inline void versioned_val<T, Merge>::set(const T &v)
 {
-  set(*revision_impl::current_revision, v);
+  assign(v);
+}
+
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::set(T &&v)
+{
+  assign(std::move(v));
+}
+
+template <class T, class Merge>
+template <class U>
+inline void versioned_val<T, Merge>::assign(U &&v)
+{
+  revision_impl &r = *revision_impl::current_revision;
+  // the write replaces whatever the pending merges would produce
+  if (!r.pending_.empty())
+    r.mark_resolved(uid_);
+#ifdef CONCURRENT_REVISIONS_PROFILE
+  if (set(r, std::forward<U>(v)))
+    profile()->writes_.fetch_add(1, std::memory_order_relaxed);
+#else
+  set(r, std::forward<U>(v));
+#endif
+}
+
+template <class T, class Merge>
+inline T &versioned_val<T, Merge>::local()
+{
+  revision_impl &r = *revision_impl::current_revision;
+  const detail::read_cache::entry *e = detail::read_cache::find(r.cache_tag_, uid_);
+  if (!e || e->version != r.current_->version_) {
+    set(get());
+    e = detail::read_cache::find(r.cache_tag_, uid_);
+  }
+  return *static_cast<T*>(const_cast<void*>(e->value));
+}
+
+// Applies the pending joins of r that this variable has not seen yet, as
+// join() would have done at the time of each join.
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::resolve(revision_impl &r)
+{
+  for (size_t i = r.resolved(uid_); i < r.pending_.size(); ++i) {
+    revision_impl &join_rev = *r.pending_[i];
+    for (segment *s = join_rev.current_; s != join_rev.root_; s = s->parent_) {
+      if (versions_.has(s->version_)) {
+        profile_merge(r, join_rev);
+        set(r, mf_(get(*r.current_), versions_.get(s->version_), get(*join_rev.root_)));
+        break;
+      }
+    }
+  }
+  r.mark_resolved(uid_);
 }
 
 template <class T, class Merge>
@@ -222,164 +851,728 @@ inline const T &versioned_val<T, Merge>::get(revision_impl &r) const
 template <class T, class Merge>
 inline const T &versioned_val<T, Merge>::get(segment &r) const
 {
-  segment *s = &r;
-  while(!versions_.has(s->version_)) {
-    s = s->parent_;
+  version_t version;
+  return get(r, version);
+}
+
+template <class T, class Merge>
+inline const T &versioned_val<T, Merge>::get(segment &r, version_t &version) const
+{
+  detail::epoch::guard g;
+  uint64_t hops = 0;
+  for (segment *s = &r; s; s = s->parent(), ++hops) {
+    const T *v = versions_.find(s->version_);
+    if (v) {
+      detail::count(detail::stat_chain_hops, hops);
+      version = s->version_;
+      return *v;
+    }
   }
-  return versions_.get(s->version_);
+  detail::count(detail::stat_chain_hops, hops);
+  version = -1;
+  return base_;
 }
 
 
 
 template <class T, class Merge>
-inline void versioned_val<T, Merge>::set(revision_impl &r, const T &v)
+template <class U>
+inline bool versioned_val<T, Merge>::set(revision_impl &r, U &&v)
+{
+  return set(r, std::forward<U>(v), *r.current_);
+}
+
+// set() that records a new version of r's current segment in written's
+// write set
+template <class T, class Merge>
+template <class U>
+inline bool versioned_val<T, Merge>::set(revision_impl &r, U &&v, segment &written)
 {
-  if (!versions_.has(r.current_->version_))
-    r.current_->written_.push_back(this->ptr());
-  versions_.set(r.current_->version_, v);
+  detail::count(detail::stat_bytes_copied, sizeof(T));
+  version_t version = r.current_->version_;
+  bool current = &r == revision_impl::current_revision;
+  if (current) {
+    // already written in this segment: update the cached cell in place
+    const detail::read_cache::entry *e = detail::read_cache::find(r.cache_tag_, uid_);
+    if (e && e->version == version) {
+      *static_cast<T*>(const_cast<void*>(e->value)) = std::forward<U>(v);
+      return false;
+    }
+  }
+
+  bool inserted;
+  const T &stored = versions_.insert_or_assign(version, std::forward<U>(v), inserted);
+  if (inserted)
+    written.add_written(this);
+  if (current)
+    detail::read_cache::put(r.cache_tag_, uid_, &stored, version);
+  return inserted;
 }
 
 template <class T, class Merge>
 inline void versioned_val<T, Merge>::release(segment &s)
 {
-  versions_.erase(s.version_);
+  if (versions_.erase(s.version_))
+    destroy();
 }
 
 template <class T, class Merge>
-inline void versioned_val<T, Merge>::collapse(revision_impl &main, segment &parent)
+inline void versioned_val<T, Merge>::collapse(const detail::merge_context &c)
 {
-  if (!versions_.has(main.current_->version_))
-    set(main, versions_.get(parent.version_));
-  versions_.erase(parent.version_);
+  revision_impl &main = *c.main;
+  version_t parent = c.join->version_;
+  // the parent's version is erased right after, so its value is moved
+  if (!dead() && !versions_.has(main.current_->version_)) {
+    detail::count(detail::stat_collapses);
+    set(main, std::move(*versions_.find(parent)), *c.written);
+  }
+  if (versions_.erase(parent))
+    destroy();
 }
 
 template <class T, class Merge>
-inline void versioned_val<T, Merge>::merge(revision_impl &main, revision_impl &join_rev, segment &join)
+inline void versioned_val<T, Merge>::merge(const detail::merge_context &c)
 {
-  segment *s = join_rev.current_;
+  revision_impl &main = *c.main;
+  if (dead() || main.resolved(uid_) > c.index) return;
+  segment *s = c.join_rev->current_;
   while(!versions_.has(s->version_))
     s = s->parent_;
-  if (s == &join) {
-    //set(main, versions_.get(join.version_));
-    set(main, mf_(get(), get(join), get(*join_rev.root_)));
+  if (s == c.join) {
+    detail::count(detail::stat_merges);
+    profile_merge(main, *c.join_rev);
+    set(main, mf_(get(*main.current_), versions_.get(c.join->version_), get(*c.join_rev->root_)),
+        *c.written);
   }
 }
 
+// Copies the value of c.join into the summary, unless a segment of the run
+// nearer to the summary's child wrote the variable.
+template <class T, class Merge>
+inline void versioned_val<T, Merge>::summarize(const detail::merge_context &c)
+{
+  version_t version = c.into->version_;
+  if (dead() || versions_.has(version)) return;
+  detail::count(detail::stat_bytes_copied, sizeof(T));
+  bool inserted;
+  versions_.insert_or_assign(version, versions_.get(c.join->version_), inserted);
+  c.written->add_written(this);
+}
+
 //-----
 
-inline segment::segment(segment *parent)
-  : parent_(parent)
+inline segment::segment()
+  : version_(0)
+  , refcount_(0)
+  , parent_(nullptr)
+  , absorbed_(nullptr)
+  , written_count_(0)
+  , sweep_at_(16)
 {
-  if (parent_) ++parent_->refcount_;
-  version_ = version_count_++; // this must be atomic?
-  refcount_ = 1;
+}
+
+inline segment *segment::create(segment *parent)
+{
+  segment *s = detail::object_pool<segment>::acquire();
+  s->parent_ = parent;
+  s->absorbed_ = nullptr;
+  if (parent) ++parent->refcount_;
+  s->version_ = version_count_++; // this must be atomic?
+  s->refcount_ = 1;
+  detail::count(detail::stat_segments_created);
+  return s;
 }
 
 inline void segment::release()
 {
-  if (--refcount_ == 0) {
-    for (size_t i = 0; i < written_.size(); ++i)
-      written_[i]->release(*this);
-    if (parent_) parent_->release();
+  segment *s = this;
+  while (s && --s->refcount_ == 0) {
+    for (size_t i = 0; i < s->written_.size(); ++i)
+      s->written_[i]->release(*s);
+    s->clear_written();
+    if (s->absorbed_) {
+      s->absorbed_->release();
+      s->absorbed_ = nullptr;
+    }
+    segment *parent = s->parent_;
+    s->parent_ = nullptr;
+    detail::object_pool<segment>::recycle(s);
+    detail::count(detail::stat_segments_released);
+    s = parent;
   }
 }
 
 inline void segment::collapse(revision_impl &main)
 {
   // assert: main.current == this
-  while(parent_ && (parent_ != main.root_ && parent_->refcount_ == 1)) {
-    for (size_t i = 0; i < parent_->written_.size(); ++i)
-      parent_->written_[i]->collapse(main, *parent_);
-    parent_ = parent_->parent_;
+  size_t n = 0, entries = 0;
+  for (segment *p = parent_; p && p != main.root_ && p->refcount_ == 1; p = p->parent_) {
+    ++n;
+    entries += p->written_count_;
+  }
+  if (n == 0) return;
+  detail::trace_scope t("collapse", "segments", n);
+
+  // the nearest parent goes first, so its values win
+  detail::run_parts(*this, entries, [&](segment &written, size_t part, size_t parts) {
+      segment *p = parent_;
+      for (size_t k = 0; k < n; ++k, p = p->parent_) {
+        detail::merge_context c = { &main, nullptr, p, 0, &written, part, parts, nullptr };
+        for (size_t i = 0; i < p->written_.size(); ++i)
+          p->written_[i]->collapse(c);
+      }
+    });
+
+  for (size_t k = 0; k < n; ++k) {
+    segment *p = parent_;
+    // p's reference to its parent is taken over by this segment
+    parent_ = p->parent_;
+    p->clear_written();
+    // nothing but this segment reads through a summary it collapses
+    if (p->absorbed_) {
+      p->absorbed_->release();
+      p->absorbed_ = nullptr;
+    }
+    p->parent_ = nullptr;
+    p->refcount_ = 0;
+    detail::object_pool<segment>::recycle(p);
   }
+  detail::count(detail::stat_segments_released, n);
 }
 
+template <class V>
+inline void segment::add_written(V *v)
+{
+  if (written_count_ >= sweep_at_)
+    sweep();
+
+  // the set of the type written last is at the back
+  detail::write_set<V> *w = nullptr;
+  for (size_t i = written_.size(); i-- > 0; ) {
+    if (written_[i]->type_ == &detail::write_set<V>::tag) {
+      w = static_cast<detail::write_set<V>*>(written_[i]);
+      if (i + 1 != written_.size())
+        std::swap(written_[i], written_.back());
+      break;
+    }
+  }
+  if (!w) {
+    w = detail::object_pool<detail::write_set<V> >::acquire();
+    written_.push_back(w);
+  }
+  w->vars_.push_back(v);
+  ++written_count_;
+}
+
+// Drops the versions of dead variables. Only the owner of a current segment
+// adds to it, so without this a revision that runs for a long time without
+// forking would keep every variable it ever wrote alive.
+inline void segment::sweep()
+{
+  written_count_ = 0;
+  for (size_t i = 0; i < written_.size(); ++i)
+    written_count_ += written_[i]->sweep(*this);
+  sweep_at_ = std::max<size_t>(16, written_count_ * 2);
+}
+
+inline void segment::clear_written()
+{
+  for (size_t i = 0; i < written_.size(); ++i)
+    written_[i]->recycle();
+  written_.clear();
+  written_count_ = 0;
+  sweep_at_ = 16;
+}
+
+//-----
+
+namespace detail {
+
+template <class V>
+inline void write_set<V>::release(segment &s)
+{
+  for (size_t i = 0; i < vars_.size(); ++i)
+    vars_[i]->release(s);
+}
+
+template <class V>
+inline void write_set<V>::collapse(const merge_context &c)
+{
+  if (c.parts == 1) {
+    for (size_t i = 0; i < vars_.size(); ++i)
+      vars_[i]->collapse(c);
+    return;
+  }
+  for (size_t i = 0; i < vars_.size(); ++i)
+    if (vars_[i]->uid() % c.parts == c.part)
+      vars_[i]->collapse(c);
+}
+
+template <class V>
+inline void write_set<V>::merge(const merge_context &c)
+{
+  if (c.parts == 1) {
+    for (size_t i = 0; i < vars_.size(); ++i)
+      vars_[i]->merge(c);
+    return;
+  }
+  for (size_t i = 0; i < vars_.size(); ++i)
+    if (vars_[i]->uid() % c.parts == c.part)
+      vars_[i]->merge(c);
+}
+
+template <class V>
+inline void write_set<V>::summarize(const merge_context &c)
+{
+  for (size_t i = 0; i < vars_.size(); ++i)
+    if (c.parts == 1 || vars_[i]->uid() % c.parts == c.part)
+      vars_[i]->summarize(c);
+}
+
+template <class V>
+inline void write_set<V>::move_to(segment &s)
+{
+  for (size_t i = 0; i < vars_.size(); ++i)
+    s.add_written(vars_[i]);
+}
+
+template <class V>
+inline size_t write_set<V>::sweep(segment &s)
+{
+  size_t j = 0;
+  for (size_t i = 0; i < vars_.size(); ++i) {
+    if (vars_[i]->dead())
+      vars_[i]->release(s);
+    else
+      vars_[j++] = vars_[i];
+  }
+  vars_.resize(j);
+  return j;
+}
+
+template <class V>
+inline void write_set<V>::recycle()
+{
+  vars_.clear();
+  object_pool<write_set>::recycle(this);
+}
+
+} // namespace detail
+
 //-----
 
-inline revision_impl::revision_impl(segment *root, segment *current)
-  : root_(root)
-  , current_(current)
-  , thread_(nullptr)
+inline revision_impl::revision_impl()
+  : root_(nullptr)
+  , current_(nullptr)
+  , cache_tag_(0)
+  , cancelled_(false)
+  , forks_since_compact_(0)
+  , compact_at_(min_compact_at)
 {
 }
 
+inline revision_impl *revision_impl::create(segment *root, segment *current)
+{
+  revision_impl *r = detail::object_pool<revision_impl>::acquire();
+  r->state_ = pending;
+  r->refcount_ = 1;
+  r->root_ = root;
+  r->current_ = current;
+  r->cache_tag_ = detail::next_uid();
+  r->cancelled_.store(false, std::memory_order_relaxed);
+  r->forks_since_compact_ = 0;
+  r->compact_at_ = min_compact_at;
+  return r;
+}
+
 template <class F>
 inline revision_impl *revision_impl::fork(F action)
 {
   // std::cout << "forking" << std::endl;
-  segment *seg = new segment(current_);
+  // the new revision reads the merged values
+  if (!pending_.empty())
+    merge_pending();
+
+  detail::count(detail::stat_forks);
+  detail::trace_scope t("fork", "revision", current_->version_);
+  detail::trace_flow('s', detail::trace_fork_flow(current_->version_));
+  segment *seg = segment::create(current_);
   // std::cout << "seg: " << seg << std::endl;
-  revision_impl *r = new revision_impl(current_, seg);
+  revision_impl *r = revision_impl::create(current_, seg);
 
   current_->release();
-  current_ = new segment(current_);
-  r->thread_ = std::unique_ptr<std::thread>(new std::thread(std::bind([](revision_impl *rr, F aa){
-      revision_impl *previous = current_revision;
-      current_revision = rr;
-      try {
-        aa();
-      } catch(...) {
-      }
-      current_revision = previous;
-      }, r, action)));
+  current_ = segment::create(current_);
+  ++forks_since_compact_;
+  r->action_.assign(std::move(action));
+  detail::scheduler::instance().spawn(r);
   return r;
 }
 
-inline void revision_impl::join(revision_impl *r)
+inline void revision_impl::execute()
 {
+  // the segment this revision forked from identifies it in traces
+  detail::trace_scope t("revision", "revision", root_->version_);
+  detail::trace_flow('f', detail::trace_fork_flow(root_->version_));
+  revision_impl *previous = current_revision;
+  current_revision = this;
   try {
-    r->thread_->join();
-    r->thread_.reset();
-
-    segment *s = r->current_;
-    while(s != r->root_) {
-      
-      for (auto p = s->written_.begin(); p != s->written_.end(); ++p)
-        (*p)->merge(*this, *r, *s);
-      s = s->parent_;
-    }
-  } catch(const std::exception& e) {
-    std::cerr << e.what() <<std::endl;
+    action_();
   } catch(...) {
   }
-  r->current_->release();
+  detail::trace_flow('s', detail::trace_join_flow(root_->version_));
+  // the joiner merges from this revision's segments only
+  if (!pending_.empty())
+    merge_pending();
+  action_.reset();
+  current_revision = previous;
+}
+
+inline void revision_impl::destroy()
+{
+  root_ = nullptr;
+  current_ = nullptr;
+  detail::object_pool<revision_impl>::recycle(this);
+}
+
+inline void revision_impl::join(revision_impl *r)
+{
+  lazy_join(r);
+  merge_pending();
+}
+
+// Waits for r and records it as a pending join. Its writes are merged
+// into a variable when this revision first reads the variable, and into
+// all variables by merge_pending(), which runs before this revision forks
+// or finishes.
+inline void revision_impl::lazy_join(revision_impl *r)
+{
+  detail::count(detail::stat_joins);
+  if (pending_.size() >= pending_limit)
+    merge_pending();
+  {
+    detail::trace_scope t("join", "revision", r->root_->version_);
+    // help running pending revisions instead of blocking
+    detail::scheduler::instance().wait(r);
+    detail::trace_flow('f', detail::trace_join_flow(r->root_->version_));
+  }
+  r->retain();
+  pending_.push_back(r);
+  // reads must look for pending merges again
+  invalidate_cache();
+}
+
+// Discards r instead of joining it. r is cancelled, so a revision that
+// has not started never runs and a running one can stop early by polling
+// cancelled(); once it has finished, its segments are released and its
+// writes dropped without any merge. Releasing many writes is left to a
+// worker thread.
+inline void revision_impl::abort(revision_impl *r)
+{
+  detail::count(detail::stat_aborts);
+  detail::trace_scope t("abort", "revision", r->root_->version_);
+  cancel(r);
+  detail::scheduler &sched = detail::scheduler::instance();
+  if (sched.cancel(r))
+    r->action_.reset();
+  else
+    sched.wait(r);
+
+  size_t entries = 0;
+  for (segment *s = r->current_; s != r->root_; s = s->parent_)
+    entries += s->written_count_;
+  if (entries < detail::parallel_merge_grain) {
+    r->current_->release();
+  } else {
+    detail::release_task *t = new detail::release_task(r->current_);
+    sched.spawn(t);
+    t->release();
+  }
+  r->current_ = nullptr;
+  // the segment r forked from may now fold into this revision's
+  if (pending_.empty()) {
+    collapse();
+    invalidate_cache();
+  }
+}
+
+// Applies the pending joins in join order. Merges of different variables
+// are independent, so large merges are split by variable among the worker
+// threads; each variable still sees the joins in order.
+inline void revision_impl::merge_pending()
+{
+  size_t entries = 0;
+  for (size_t i = 0; i < pending_.size(); ++i)
+    for (segment *s = pending_[i]->current_; s != pending_[i]->root_; s = s->parent_)
+      entries += s->written_count_;
+  detail::trace_scope t("merge", "entries", entries);
+
+  detail::run_parts(*current_, entries, [this](segment &written, size_t part, size_t parts) {
+      merge_part(written, part, parts);
+    });
+
+  resolved_.clear();
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    pending_[i]->current_->release();
+    pending_[i]->release();
+  }
+  pending_.clear();
+  collapse();
+  // merges and collapses moved values of this revision to other versions
+  invalidate_cache();
+}
+
+inline void revision_impl::merge_part(segment &written, size_t part, size_t parts)
+{
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    revision_impl *r = pending_[i];
+    try {
+      for (segment *s = r->current_; s != r->root_; s = s->parent_) {
+        detail::merge_context c = { this, r, s, i, &written, part, parts, nullptr };
+        for (size_t j = 0; j < s->written_.size(); ++j)
+          s->written_[j]->merge(c);
+      }
+    } catch(const std::exception& e) {
+      std::cerr << e.what() <<std::endl;
+    } catch(...) {
+    }
+  }
+}
+
+inline void revision_impl::collapse()
+{
   current_->collapse(*this);
+  if (forks_since_compact_ >= compact_at_)
+    compact();
+}
+
+// Collapse stops at the first segment another revision forked from, so
+// while some of them run, the segments below pile up and every read walks
+// them. This replaces each run of two or more segments of this revision
+// that no other revision forked from by a summary segment holding the
+// value the run gives each variable it wrote, nearest first.
+//
+// Revisions forked from the segments between current_ and the run may be
+// reading it, and may hold references to its values, so the summary keeps
+// the run until they have all finished: until no segment between current_
+// and the summary older than it is forked from. The chain then holds at
+// most two segments per revision forked from it and still alive, plus
+// those forked since the last compaction.
+inline void revision_impl::compact()
+{
+  detail::trace_scope t("compact");
+  size_t length = 0;
+  version_t oldest_forked = std::numeric_limits<version_t>::max();
+  segment *prev = current_;
+  segment *s = current_->parent_;
+  while (s && s != root_) {
+    if (s->refcount_ != 1) {
+      oldest_forked = std::min<version_t>(oldest_forked, s->version_);
+      ++length;
+      prev = s;
+      s = s->parent_;
+      continue;
+    }
+
+    size_t n = 0, entries = 0;
+    segment *last = s;
+    for (segment *p = s; p != root_ && p->refcount_ == 1; p = p->parent_) {
+      if (p->absorbed_ && oldest_forked > p->version_) {
+        p->absorbed_->release();
+        p->absorbed_ = nullptr;
+      }
+      ++n;
+      entries += p->written_count_;
+      last = p;
+    }
+    if (n < 2 || prev == current_) {
+      length += n;
+      prev = last;
+      s = last->parent_;
+      continue;
+    }
+
+    segment *summary = segment::create(last->parent_);
+    // prev's reference to the run is taken over by the summary
+    summary->absorbed_ = s;
+    detail::run_parts(*summary, entries, [&](segment &written, size_t part, size_t parts) {
+        segment *p = s;
+        for (size_t k = 0; k < n; ++k, p = p->parent_) {
+          detail::merge_context c = { this, nullptr, p, 0, &written, part, parts, summary };
+          for (size_t i = 0; i < p->written_.size(); ++i)
+            p->written_[i]->summarize(c);
+        }
+      });
+    // readers that load the new parent see the summary's versions
+    __atomic_store_n(&prev->parent_, summary, __ATOMIC_RELEASE);
+    ++length;
+    prev = summary;
+    s = summary->parent_;
+  }
+  forks_since_compact_ = 0;
+  compact_at_ = std::max<size_t>(size_t(min_compact_at), length);
+}
+
+inline void revision_impl::cancel(revision_impl *r)
+{
+  r->cancelled_.store(true, std::memory_order_relaxed);
+}
+
+inline size_t revision_impl::resolved(uint64_t uid) const
+{
+  std::unordered_map<uint64_t, size_t>::const_iterator it = resolved_.find(uid);
+  return it == resolved_.end() ? 0 : it->second;
+}
+
+inline void revision_impl::mark_resolved(uint64_t uid)
+{
+  resolved_[uid] = pending_.size();
 }
 
 class revision {
 public:
-  revision() {}
+  revision()
+    : impl_(nullptr) {}
 
+  // takes over a reference to impl
   explicit revision(revision_impl *impl)
     : impl_(impl) {}
 
-  revision_impl *ptr() {
-    return impl_.get();
+  revision(const revision &r)
+    : impl_(r.impl_) {
+    if (impl_) impl_->retain();
+  }
+
+  revision(revision &&r)
+    : impl_(r.impl_) {
+    r.impl_ = nullptr;
+  }
+
+  ~revision() {
+    if (impl_) impl_->release();
+  }
+
+  revision &operator=(revision r) {
+    std::swap(impl_, r.impl_);
+    return *this;
+  }
+
+  revision_impl *ptr() const {
+    return impl_;
   }
 
 private:
-  std::shared_ptr<revision_impl> impl_;
+  revision_impl *impl_;
 };
 
 //-----
 
+namespace detail {
+
+// releases the root revision of a thread when the thread exits
+class root_revision {
+public:
+  root_revision()
+    : r_(nullptr) {}
+
+  ~root_revision() {
+    if (!r_) return;
+    if (revision_impl::current_revision == r_)
+      revision_impl::current_revision = nullptr;
+    r_->merge_pending();
+    r_->current_->release();
+    r_->release();
+  }
+
+  static void create() {
+    attach_stats();
+    static thread_local root_revision holder;
+    segment *root_segment = segment::create(nullptr);
+    holder.r_ = revision_impl::create(root_segment, root_segment);
+    revision_impl::current_revision = holder.r_;
+  }
+
+private:
+  revision_impl *r_;
+};
+
+} // namespace detail
+
 template <typename F>
 inline revision fork(F action)
 {
-  if (!revision_impl::current_revision) {
-    segment *root_segment = new segment(nullptr);
-
-    revision_impl::current_revision = new revision_impl(root_segment, root_segment);
-  }
+  if (!revision_impl::current_revision)
+    detail::root_revision::create();
 
   return revision(revision_impl::current_revision->fork(action));
 }
 
-inline void join(revision r)
+inline void join(const revision &r)
 {
   revision_impl::current_revision->join(r.ptr());
 }
 
+// join() that defers merging r's writes into a variable until the joiner
+// reads it, so the join itself does not depend on how much r wrote
+inline void lazy_join(const revision &r)
+{
+  revision_impl::current_revision->lazy_join(r.ptr());
+}
+
+// joins every revision of rs, in order; the merges run on the worker
+// threads when the revisions wrote many variables
+template <class Range>
+inline void join_all(const Range &rs)
+{
+  revision_impl *self = revision_impl::current_revision;
+  for (auto p = std::begin(rs); p != std::end(rs); ++p)
+    self->lazy_join(p->ptr());
+  self->merge_pending();
+}
+
+// Discards r without merging its writes; r must not be joined afterwards.
+// If r is running, this waits until it finishes, which it can hurry by
+// polling cancelled().
+inline void abort(const revision &r)
+{
+  revision_impl::current_revision->abort(r.ptr());
+}
+
+// whether the current revision has been aborted; revisions it forked are
+// not cancelled with it and must still be joined or aborted
+inline bool cancelled()
+{
+  revision_impl *self = revision_impl::current_revision;
+  return self && self->cancelled_.load(std::memory_order_relaxed);
+}
+
+// Joins the first revision of rs to finish and aborts the others. Returns
+// the index of the joined one, or 0 if rs is empty.
+//
+// While it waits, this thread runs queued tasks. On a worker, whose own
+// tasks run newest first, that may be the last revision of rs forked,
+// which then runs to the end even if another one finishes meanwhile: it
+// is only cancelled after the wait. The wait is then bounded by that
+// revision, not by the winner.
+template <class Range>
+inline size_t join_first(const Range &rs)
+{
+  revision_impl *self = revision_impl::current_revision;
+  std::vector<detail::task*> ts;
+  for (auto p = std::begin(rs); p != std::end(rs); ++p)
+    ts.push_back(p->ptr());
+  if (ts.empty()) return 0;
+  size_t first = detail::scheduler::instance().wait_any(ts.data(), ts.size());
+  // all the others stop at once instead of each after the one before
+  for (size_t i = 0; i < ts.size(); ++i)
+    if (i != first)
+      self->cancel(static_cast<revision_impl*>(ts[i]));
+  for (size_t i = 0; i < ts.size(); ++i)
+    if (i != first)
+      self->abort(static_cast<revision_impl*>(ts[i]));
+  self->join(static_cast<revision_impl*>(ts[first]));
+  return first;
+}
+
 namespace detail_ {
 class initializer {
 public:
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace concurrent_revisions {
+namespace detail {
+
+// Epoch-based reclamation.
+//
+// Readers of a lock-free structure hold an epoch::guard while they may see
+// memory that writers unlink concurrently. Writers hand unlinked memory to
+// retire(), which frees it once every thread that could still see it has
+// left its guard. Both sides have to access the shared pointer they unlink
+// or follow with seq_cst operations.
+class epoch_record {
+public:
+  epoch_record()
+    : local(0)
+    , in_use(true)
+    , next(nullptr)
+    , nest(0) {
+  }
+
+  struct retired {
+    void *p;
+    void (*deleter)(void*);
+    uint64_t epoch;
+  };
+
+  std::atomic<uint64_t> local; // 0 while outside of a guard
+  std::atomic_bool in_use;
+  epoch_record *next;
+  int nest;
+  std::vector<retired> limbo;
+};
+
+} // namespace detail
+
+namespace detail_ {
+template <typename = void>
+class epoch_ {
+public:
+  static std::atomic<uint64_t> global_;
+  static std::atomic<detail::epoch_record*> records_;
+  static std::mutex orphans_m_;
+  static std::vector<detail::epoch_record::retired> *orphans_;
+  static __thread detail::epoch_record *record_;
+};
+
+template <typename T>
+std::atomic<uint64_t> epoch_<T>::global_(1);
+
+template <typename T>
+std::atomic<detail::epoch_record*> epoch_<T>::records_(nullptr);
+
+template <typename T>
+std::mutex epoch_<T>::orphans_m_;
+
+template <typename T>
+std::vector<detail::epoch_record::retired> *epoch_<T>::orphans_ = nullptr;
+
+template <typename T>
+__thread detail::epoch_record *epoch_<T>::record_ = nullptr;
+} // namespace detail_
+
+namespace detail {
+
+class epoch : public detail_::epoch_<> {
+public:
+  static const size_t collect_threshold = 64;
+
+  class guard {
+  public:
+    guard() { enter(); }
+    ~guard() { exit(); }
+  private:
+    guard(const guard &);
+    guard &operator=(const guard &);
+  };
+
+  static void enter() {
+    epoch_record *r = record_ ? record_ : attach();
+    // announcing the epoch must not be reordered with the loads that
+    // follow, hence a seq_cst read-modify-write rather than a plain store
+    if (r->nest++ == 0)
+      r->local.exchange(global_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+  }
+
+  static void exit() {
+    epoch_record *r = record_;
+    if (--r->nest == 0)
+      r->local.store(0, std::memory_order_release);
+  }
+
+  template <class T>
+  static void retire(T *p) {
+    epoch_record *r = record_ ? record_ : attach();
+    epoch_record::retired e = { p, &delete_object<T>, global_.load(std::memory_order_seq_cst) };
+    r->limbo.push_back(e);
+    if (r->limbo.size() >= collect_threshold)
+      collect(r);
+  }
+
+private:
+  template <class T>
+  static void delete_object(void *p) {
+    delete static_cast<T*>(p);
+  }
+
+  // releases this thread's record at thread exit
+  class detacher {
+  public:
+    ~detacher() {
+      epoch_record *r = record_;
+      if (!r) return;
+      collect(r);
+      if (!r->limbo.empty()) {
+        std::lock_guard<std::mutex> lk(orphans_m_);
+        if (!orphans_) orphans_ = new std::vector<epoch_record::retired>();
+        orphans_->insert(orphans_->end(), r->limbo.begin(), r->limbo.end());
+        r->limbo.clear();
+      }
+      record_ = nullptr;
+      r->in_use.store(false, std::memory_order_release);
+    }
+  };
+
+  static epoch_record *attach() {
+    static thread_local detacher d;
+    (void)d;
+
+    for (epoch_record *r = records_.load(); r; r = r->next) {
+      bool expected = false;
+      if (!r->in_use.load() && r->in_use.compare_exchange_strong(expected, true))
+        return record_ = r;
+    }
+
+    epoch_record *r = new epoch_record();
+    epoch_record *head = records_.load();
+    do {
+      r->next = head;
+    } while (!records_.compare_exchange_weak(head, r));
+    return record_ = r;
+  }
+
+  static void try_advance() {
+    uint64_t e = global_.load(std::memory_order_seq_cst);
+    for (epoch_record *r = records_.load(); r; r = r->next) {
+      uint64_t l = r->local.load(std::memory_order_seq_cst);
+      if (l != 0 && l != e) return;
+    }
+    global_.compare_exchange_strong(e, e + 1);
+  }
+
+  static void collect(epoch_record *r) {
+    try_advance();
+    uint64_t e = global_.load(std::memory_order_seq_cst);
+    free_expired(r->limbo, e);
+
+    std::unique_lock<std::mutex> lk(orphans_m_, std::try_to_lock);
+    if (lk.owns_lock() && orphans_)
+      free_expired(*orphans_, e);
+  }
+
+  // frees what was retired two or more epochs ago
+  static void free_expired(std::vector<epoch_record::retired> &v, uint64_t e) {
+    size_t j = 0;
+    for (size_t i = 0; i < v.size(); ++i) {
+      if (v[i].epoch + 2 <= e)
+        v[i].deleter(v[i].p);
+      else
+        v[j++] = v[i];
+    }
+    v.resize(j);
+  }
+};
+
+} // namespace detail
+} // namespace concurrent_revisions
@@ -0,0 +1,345 @@
+// Benchmark suite with warmup, repetitions, percentiles and JSON output.
+//
+//   microbench [--filter SUBSTR] [--reps N] [--warmup N] [--size N] [--json FILE]
+//
+// Every case is run warmup + reps times. A run reports how long its
+// measured part took for a number of items, and the suite prints the
+// min, percentiles and max of nanoseconds per item over the reps to
+// stderr, and as JSON to FILE ("-" for stdout).
+
+#include "concurrent_revisions.h"
+#include "util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace concurrent_revisions;
+using namespace std;
+
+namespace {
+
+class stopwatch {
+public:
+  stopwatch()
+    : start_(chrono::steady_clock::now()) {}
+
+  double ns() const {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start_).count();
+  }
+
+private:
+  chrono::steady_clock::time_point start_;
+};
+
+struct result {
+  string name;
+  double items;
+  // nanoseconds per item, sorted
+  vector<double> samples;
+
+  double percentile(double p) const {
+    size_t i = size_t(p / 100 * (samples.size() - 1) + 0.5);
+    return samples[i];
+  }
+};
+
+class suite {
+public:
+  suite()
+    : reps_(10)
+    , warmup_(2)
+    , size_(1 << 22) {}
+
+  bool parse(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+      if (i + 1 >= argc) return false;
+      if (strcmp(argv[i], "--filter") == 0) filter_ = argv[++i];
+      else if (strcmp(argv[i], "--reps") == 0) reps_ = max(1, atoi(argv[++i]));
+      else if (strcmp(argv[i], "--warmup") == 0) warmup_ = max(0, atoi(argv[++i]));
+      else if (strcmp(argv[i], "--size") == 0) size_ = max(1, atoi(argv[++i]));
+      else if (strcmp(argv[i], "--json") == 0) json_ = argv[++i];
+      else return false;
+    }
+    return true;
+  }
+
+  // number of elements for the algorithm cases
+  size_t size() const {
+    return size_;
+  }
+
+  // f() runs the case once and returns the nanoseconds its measured part
+  // took for the given number of items
+  void run(const string &name, double items, const function<double()> &f) {
+    if (!filter_.empty() && name.find(filter_) == string::npos)
+      return;
+    for (int i = 0; i < warmup_; ++i)
+      f();
+    result r;
+    r.name = name;
+    r.items = items;
+    for (int i = 0; i < reps_; ++i)
+      r.samples.push_back(f() / items);
+    sort(r.samples.begin(), r.samples.end());
+    fprintf(stderr, "%-40s %12.2f %12.2f %12.2f %12.2f ns/item\n", name.c_str(),
+            r.samples.front(), r.percentile(50), r.percentile(90), r.samples.back());
+    results_.push_back(r);
+  }
+
+  // runs g as the measured part
+  void timed(const string &name, double items, const function<void()> &g) {
+    run(name, items, [&] {
+        stopwatch w;
+        g();
+        return w.ns();
+      });
+  }
+
+  void header() const {
+    fprintf(stderr, "%d threads, %d reps after %d warmup runs\n",
+            (int)detail::scheduler::instance().size(), reps_, warmup_);
+    fprintf(stderr, "%-40s %12s %12s %12s %12s\n", "case", "min", "p50", "p90", "max");
+  }
+
+  bool write_json() const {
+    if (json_.empty()) return true;
+    FILE *out = json_ == "-" ? stdout : fopen(json_.c_str(), "w");
+    if (!out) return false;
+    fprintf(out, "{\n  \"threads\": %d,\n  \"hardware_concurrency\": %u,\n",
+            (int)detail::scheduler::instance().size(), thread::hardware_concurrency());
+    fprintf(out, "  \"reps\": %d,\n  \"warmup\": %d,\n  \"results\": [\n", reps_, warmup_);
+    for (size_t i = 0; i < results_.size(); ++i) {
+      const result &r = results_[i];
+      fprintf(out, "    {\"name\": \"%s\", \"items\": %.0f, \"ns_per_item\": "
+              "{\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}, "
+              "\"items_per_sec\": %.1f}%s\n",
+              r.name.c_str(), r.items, r.samples.front(), r.percentile(50), r.percentile(90),
+              r.percentile(99), r.samples.back(), 1e9 / r.percentile(50),
+              i + 1 < results_.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return true;
+  }
+
+private:
+  int reps_;
+  int warmup_;
+  int size_;
+  string filter_;
+  string json_;
+  vector<result> results_;
+};
+
+string name(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+string name(const char *format, ...)
+{
+  char buf[128];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  return buf;
+}
+
+void fork_join(suite &s)
+{
+  const int n = 10000;
+  s.timed("fork+join", n, [] {
+      for (int i = 0; i < n; ++i) {
+        revision r = fork([] {});
+        join(r);
+      }
+    });
+
+  versioned<int, add_merger<int> > x;
+  s.timed("fork+join writing a variable", n, [&] {
+      for (int i = 0; i < n; ++i) {
+        revision r = fork([&] { x = x + 1; });
+        join(r);
+      }
+    });
+}
+
+// get and set with the variable's version depth segments up the chain, by
+// 1, 2, 4, ... revisions at once
+void get_set(suite &s)
+{
+  const int n = 1000000;
+  size_t threads = detail::scheduler::instance().size();
+  for (int depth = 1; depth <= 64; depth *= 4) {
+    for (size_t t = 1; t <= threads; t *= 2) {
+      versioned<int> x;
+      x = 1;
+      vector<revision> chain;
+      for (int i = 1; i < depth; ++i)
+        chain.push_back(fork([] {}));
+
+      auto readers = [&] {
+        vector<revision> rs;
+        stopwatch w;
+        for (size_t k = 0; k < t; ++k) {
+          rs.push_back(fork([&] {
+                int64_t sum = 0;
+                for (int i = 0; i < n; ++i) sum += x;
+                if (sum == 0) std::abort();
+              }));
+        }
+        for (size_t k = 0; k < t; ++k) join(rs[k]);
+        return w.ns();
+      };
+      s.run(name("get/depth=%d/revisions=%d", depth, (int)t), double(n) * t, readers);
+
+      auto writers = [&] {
+        vector<revision> rs;
+        stopwatch w;
+        for (size_t k = 0; k < t; ++k) {
+          rs.push_back(fork([&] {
+                for (int i = 0; i < n; ++i) x = i;
+              }));
+        }
+        for (size_t k = 0; k < t; ++k) join(rs[k]);
+        return w.ns();
+      };
+      s.run(name("set/depth=%d/revisions=%d", depth, (int)t), double(n) * t, writers);
+
+      for (size_t i = 0; i < chain.size(); ++i) join(chain[i]);
+    }
+  }
+}
+
+// join of a finished revision against the number of variables it wrote
+void join_cost(suite &s)
+{
+  for (int n = 1; n <= 1 << 18; n *= 8) {
+    vector<versioned<int, add_merger<int> > > xs(n);
+    s.run(name("join/written=%d", n), n, [&] {
+        revision r = fork([&] {
+            for (int i = 0; i < n; ++i) xs[i] = xs[i] + 1;
+          });
+        detail::scheduler::instance().wait(r.ptr());
+        stopwatch w;
+        join(r);
+        return w.ns();
+      });
+  }
+}
+
+// folding a segment that wrote n variables into the joiner's current one,
+// which the join of an empty revision forked after the writes does
+void collapse_cost(suite &s)
+{
+  for (int n = 1; n <= 1 << 18; n *= 8) {
+    vector<versioned<int> > xs(n);
+    s.run(name("collapse/written=%d", n), n, [&] {
+        double ns = 0;
+        revision outer = fork([&] {
+            for (int i = 0; i < n; ++i) xs[i] = i;
+            revision r = fork([] {});
+            detail::scheduler::instance().wait(r.ptr());
+            stopwatch w;
+            join(r);
+            ns = w.ns();
+          });
+        join(outer);
+        return ns;
+      });
+  }
+}
+
+// every util.h algorithm against its std:: counterpart
+void algorithms(suite &s)
+{
+  const size_t n = s.size();
+  vector<uint32_t> keys(n);
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < n; ++i) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    keys[i] = x;
+  }
+  vector<uint32_t> v, w(n);
+  vector<uint64_t> sums(n);
+  auto reset = [&] { v = keys; };
+  auto cheap = [](uint32_t k) { return k * 2654435761u + 1; };
+
+  // pairs of (std, parallel) runs; copying the input is not measured
+  auto pair = [&](const char *algo, const function<void()> &seq, const function<void()> &par) {
+    s.run(name("%s/std", algo), n, [&] { reset(); stopwatch t; seq(); return t.ns(); });
+    s.run(name("%s/parallel", algo), n, [&] { reset(); stopwatch t; par(); return t.ns(); });
+  };
+
+  pair("foreach",
+       [&] { for_each(v.begin(), v.end(), [&](uint32_t &k) { k = cheap(k); }); },
+       [&] { parallel_foreach(v.begin(), v.end(), [&](uint32_t &k) { k = cheap(k); }); });
+  pair("transform",
+       [&] { transform(v.begin(), v.end(), w.begin(), cheap); },
+       [&] { parallel_transform(v.begin(), v.end(), w.begin(), cheap); });
+  pair("transform2",
+       [&] { transform(v.begin(), v.end(), keys.begin(), w.begin(), plus<uint32_t>()); },
+       [&] { parallel_transform(v.begin(), v.end(), keys.begin(), keys.end(), w.begin(), plus<uint32_t>()); });
+  pair("max_element",
+       [&] { if (*max_element(v.begin(), v.end()) == 0) std::abort(); },
+       [&] { if (*parallel_max_element(v.begin(), v.end()) == 0) std::abort(); });
+  pair("min_element",
+       [&] { if (*min_element(v.begin(), v.end()) == ~0u) std::abort(); },
+       [&] { if (*parallel_min_element(v.begin(), v.end()) == ~0u) std::abort(); });
+  pair("swap_ranges",
+       [&] { swap_ranges(v.begin(), v.end(), w.begin()); },
+       [&] { parallel_swap_ranges(v.begin(), v.end(), w.begin()); });
+  pair("reduce",
+       [&] { sums[0] = accumulate(v.begin(), v.end(), uint64_t(0)); },
+       [&] { sums[0] = parallel_reduce(v.begin(), v.end(), uint64_t(0)); });
+  pair("inclusive_scan",
+       [&] { partial_sum(v.begin(), v.end(), sums.begin()); },
+       [&] { parallel_inclusive_scan(v.begin(), v.end(), sums.begin()); });
+  pair("exclusive_scan",
+       [&] { sums[0] = 0; partial_sum(v.begin(), v.end() - 1, sums.begin() + 1); },
+       [&] { parallel_exclusive_scan(v.begin(), v.end(), sums.begin(), uint32_t(0)); });
+  // the key sits at 2% of the range
+  pair("find_if",
+       [&] { uint32_t k = v[n / 50]; if (find(v.begin(), v.end(), k) == v.end()) std::abort(); },
+       [&] { uint32_t k = v[n / 50]; if (parallel_find_if(v.begin(), v.end(), [k](uint32_t y) { return y == k; }) == v.end()) std::abort(); });
+  pair("all_of",
+       [&] { if (!all_of(v.begin(), v.end(), [](uint32_t y) { return y != 0; })) std::abort(); },
+       [&] { if (!parallel_all_of(v.begin(), v.end(), [](uint32_t y) { return y != 0; })) std::abort(); });
+  pair("sort",
+       [&] { sort(v.begin(), v.end()); },
+       [&] { parallel_sort(v.begin(), v.end()); });
+  pair("stable_sort",
+       [&] { stable_sort(v.begin(), v.end()); },
+       [&] { parallel_stable_sort(v.begin(), v.end()); });
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  suite s;
+  if (!s.parse(argc, argv)) {
+    fprintf(stderr, "usage: %s [--filter SUBSTR] [--reps N] [--warmup N] [--size N] [--json FILE]\n", argv[0]);
+    return 1;
+  }
+
+  s.header();
+  fork_join(s);
+  get_set(s);
+  join_cost(s);
+  collapse_cost(s);
+  algorithms(s);
+
+  if (!s.write_json()) {
+    fprintf(stderr, "cannot write the JSON output\n");
+    return 1;
+  }
+  return 0;
+}
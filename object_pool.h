@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace concurrent_revisions {
+namespace detail {
+
+// Base of objects recycled through object_pool<T>.
+template <class T>
+class pooled {
+public:
+  pooled() : pool_next_(nullptr) {}
+
+  T *pool_next_;
+};
+
+} // namespace detail
+
+namespace detail_ {
+template <class T>
+class object_pool_ {
+public:
+  static __thread T *local_;
+  static __thread size_t local_size_;
+  static __thread bool exited_;
+  static T *global_;
+  static size_t global_size_;
+  static std::vector<T*> *slabs_;
+  static std::mutex global_m_;
+};
+
+template <class T>
+__thread T *object_pool_<T>::local_ = nullptr;
+
+template <class T>
+__thread size_t object_pool_<T>::local_size_ = 0;
+
+template <class T>
+__thread bool object_pool_<T>::exited_ = false;
+
+template <class T>
+T *object_pool_<T>::global_ = nullptr;
+
+template <class T>
+size_t object_pool_<T>::global_size_ = 0;
+
+template <class T>
+std::vector<T*> *object_pool_<T>::slabs_ = nullptr;
+
+template <class T>
+std::mutex object_pool_<T>::global_m_;
+} // namespace detail_
+
+namespace detail {
+
+// Thread-local free lists of constructed T objects.
+//
+// Objects keep their state (e.g. reserved vector capacity) while they are
+// in the pool, so callers reinitialize them after acquire(). Threads that
+// free more than they allocate hand batches over to a global list, threads
+// that run dry take a batch from it, and new objects are allocated in slabs.
+// A thread's list goes back to the global one when the thread exits.
+// Memory is never returned to the system; the pool only grows to the peak
+// number of live objects.
+template <class T>
+class object_pool : public detail_::object_pool_<T> {
+  typedef detail_::object_pool_<T> base;
+
+public:
+  static const size_t slab_size = 64;
+  static const size_t local_limit = 256;
+
+  static T *acquire() {
+    if (!base::local_) refill();
+    T *p = base::local_;
+    base::local_ = p->pool_next_;
+    --base::local_size_;
+    p->pool_next_ = nullptr;
+    return p;
+  }
+
+  static void recycle(T *p) {
+    if (!base::local_) {
+      if (base::exited_) {
+        give_back(p);
+        return;
+      }
+      hold();
+    }
+    p->pool_next_ = base::local_;
+    base::local_ = p;
+    if (++base::local_size_ > local_limit) spill();
+  }
+
+private:
+  // returns the thread's list to the global one at thread exit
+  class returner {
+  public:
+    ~returner() {
+      base::exited_ = true;
+      std::lock_guard<std::mutex> lk(base::global_m_);
+      while (base::local_) {
+        T *p = base::local_;
+        base::local_ = p->pool_next_;
+        p->pool_next_ = base::global_;
+        base::global_ = p;
+        ++base::global_size_;
+      }
+      base::local_size_ = 0;
+    }
+  };
+
+  static void hold() {
+    static thread_local returner r;
+    (void)r;
+  }
+
+  static void give_back(T *p) {
+    std::lock_guard<std::mutex> lk(base::global_m_);
+    p->pool_next_ = base::global_;
+    base::global_ = p;
+    ++base::global_size_;
+  }
+
+  static void refill() {
+    if (base::exited_) {
+      // objects used by later thread_local destructors go one at a time
+      T *p = nullptr;
+      {
+        std::lock_guard<std::mutex> lk(base::global_m_);
+        if (base::global_) {
+          p = base::global_;
+          base::global_ = p->pool_next_;
+          --base::global_size_;
+        }
+      }
+      if (!p) p = new T();
+      p->pool_next_ = nullptr;
+      base::local_ = p;
+      base::local_size_ = 1;
+      return;
+    }
+    hold();
+    {
+      std::lock_guard<std::mutex> lk(base::global_m_);
+      while (base::global_ && base::local_size_ < local_limit / 2) {
+        T *p = base::global_;
+        base::global_ = p->pool_next_;
+        --base::global_size_;
+        p->pool_next_ = base::local_;
+        base::local_ = p;
+        ++base::local_size_;
+      }
+    }
+    if (base::local_) return;
+
+    T *slab = new T[slab_size];
+    {
+      // slabs stay reachable for leak checkers, even after exit
+      std::lock_guard<std::mutex> lk(base::global_m_);
+      if (!base::slabs_) base::slabs_ = new std::vector<T*>();
+      base::slabs_->push_back(slab);
+    }
+    for (size_t i = 0; i < slab_size; ++i) {
+      slab[i].pool_next_ = base::local_;
+      base::local_ = &slab[i];
+    }
+    base::local_size_ += slab_size;
+  }
+
+  static void spill() {
+    std::lock_guard<std::mutex> lk(base::global_m_);
+    while (base::local_size_ > local_limit / 2) {
+      T *p = base::local_;
+      base::local_ = p->pool_next_;
+      --base::local_size_;
+      p->pool_next_ = base::global_;
+      base::global_ = p;
+      ++base::global_size_;
+    }
+  }
+};
+
+} // namespace detail
+} // namespace concurrent_revisions
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+// "file:line" of where it is used, for naming variables by source location
+#define CONCURRENT_REVISIONS_STR_(x) #x
+#define CONCURRENT_REVISIONS_STR(x) CONCURRENT_REVISIONS_STR_(x)
+#define CONCURRENT_REVISIONS_HERE __FILE__ ":" CONCURRENT_REVISIONS_STR(__LINE__)
+
+namespace concurrent_revisions {
+
+// What the profiler counted for the variables of one name. Variables
+// named alike, e.g. all the elements of a vector, are counted together,
+// and so are the unnamed variables of each type.
+struct variable_profile {
+  std::string name;
+  // variables given the name, or unnamed ones written or merged
+  uint64_t variables;
+  // segments that wrote the variable, each holding a copy of its value
+  uint64_t writes;
+  // joins that merged a value of the variable
+  uint64_t merges;
+  // merges where the joiner had also written the variable since the fork
+  uint64_t conflicts;
+  // conflicts where default_merger dropped the joiner's value
+  uint64_t discarded;
+};
+
+namespace detail {
+
+class var_profile {
+public:
+  explicit var_profile(const std::string &name)
+    : name_(name) {
+    clear();
+  }
+
+  void clear() {
+    variables_.store(0, std::memory_order_relaxed);
+    writes_.store(0, std::memory_order_relaxed);
+    merges_.store(0, std::memory_order_relaxed);
+    conflicts_.store(0, std::memory_order_relaxed);
+    discarded_.store(0, std::memory_order_relaxed);
+  }
+
+  variable_profile get() const {
+    variable_profile p;
+    p.name = name_;
+    p.variables = variables_.load(std::memory_order_relaxed);
+    p.writes = writes_.load(std::memory_order_relaxed);
+    p.merges = merges_.load(std::memory_order_relaxed);
+    p.conflicts = conflicts_.load(std::memory_order_relaxed);
+    p.discarded = discarded_.load(std::memory_order_relaxed);
+    return p;
+  }
+
+  const std::string name_;
+  std::atomic<uint64_t> variables_;
+  std::atomic<uint64_t> writes_;
+  std::atomic<uint64_t> merges_;
+  std::atomic<uint64_t> conflicts_;
+  std::atomic<uint64_t> discarded_;
+};
+
+// the records of all names, kept until the program exits
+class profile_registry {
+public:
+  static profile_registry &instance() {
+    static profile_registry r;
+    return r;
+  }
+
+  // the record of name, counting one more variable
+  var_profile *add(const std::string &name) {
+    std::lock_guard<std::mutex> lk(m_);
+    var_profile *p = record(name);
+    p->variables_.fetch_add(1, std::memory_order_relaxed);
+    return p;
+  }
+
+  // the record of the unnamed variables of type t
+  var_profile *add(const std::type_info &t) {
+    std::string name = "unnamed ";
+    int status;
+    char *s = abi::__cxa_demangle(t.name(), nullptr, nullptr, &status);
+    name += s ? s : t.name();
+    std::free(s);
+    return add(name);
+  }
+
+  template <class F>
+  void for_each(F f) {
+    std::lock_guard<std::mutex> lk(m_);
+    for (auto it = records_.begin(); it != records_.end(); ++it)
+      f(*it->second);
+  }
+
+private:
+  var_profile *record(const std::string &name) {
+    std::unique_ptr<var_profile> &p = records_[name];
+    if (!p) p.reset(new var_profile(name));
+    return p.get();
+  }
+
+  std::mutex m_;
+  std::map<std::string, std::unique_ptr<var_profile> > records_;
+};
+
+} // namespace detail
+
+// The names with the most merges, then the most writes, first. Counting
+// is only done when CONCURRENT_REVISIONS_PROFILE is defined; call this
+// when no revision is running.
+inline std::vector<variable_profile> profile_report(size_t top = 10)
+{
+  std::vector<variable_profile> r;
+  detail::profile_registry::instance().for_each([&](const detail::var_profile &p) {
+      variable_profile v = p.get();
+      if (v.writes || v.merges) r.push_back(v);
+    });
+  std::sort(r.begin(), r.end(), [](const variable_profile &a, const variable_profile &b) {
+      return a.merges != b.merges ? a.merges > b.merges : a.writes > b.writes;
+    });
+  if (r.size() > top) r.resize(top);
+  return r;
+}
+
+inline void write_profile_report(std::ostream &os, size_t top = 10)
+{
+  std::vector<variable_profile> r = profile_report(top);
+  os << std::setw(10) << "variables" << std::setw(12) << "writes" << std::setw(12) << "merges"
+     << std::setw(12) << "conflicts" << std::setw(12) << "discarded" << "  name\n";
+  for (size_t i = 0; i < r.size(); ++i)
+    os << std::setw(10) << r[i].variables << std::setw(12) << r[i].writes
+       << std::setw(12) << r[i].merges << std::setw(12) << r[i].conflicts
+       << std::setw(12) << r[i].discarded << "  " << r[i].name << "\n";
+}
+
+// zeroes the counts; call this when no revision is running
+inline void clear_profile()
+{
+  detail::profile_registry::instance().for_each([](detail::var_profile &p) {
+      uint64_t n = p.variables_.load(std::memory_order_relaxed);
+      p.clear();
+      p.variables_.store(n, std::memory_order_relaxed);
+    });
+}
+
+} // namespace concurrent_revisions
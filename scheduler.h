@@ -0,0 +1,260 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace concurrent_revisions {
+namespace detail {
+
+// unit of work run by the scheduler
+class task {
+public:
+  enum { pending, running, finished };
+
+  task() : state_(pending), refcount_(1) {}
+  virtual ~task() {}
+
+  virtual void execute() = 0;
+
+  // called when the last reference is released
+  virtual void destroy() {
+    delete this;
+  }
+
+  bool finished_p() const {
+    return state_.load(std::memory_order_acquire) == finished;
+  }
+
+  void retain() {
+    refcount_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void release() {
+    if (refcount_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      destroy();
+  }
+
+  std::atomic_int state_;
+  std::atomic_int refcount_;
+};
+
+// per-thread deque: the owner pushes and pops at the back,
+// thieves take from the front
+class task_deque {
+public:
+  void push(task *t) {
+    std::lock_guard<std::mutex> lk(m_);
+    dat_.push_back(t);
+  }
+
+  task *pop() {
+    std::lock_guard<std::mutex> lk(m_);
+    if (dat_.empty()) return nullptr;
+    task *t = dat_.back();
+    dat_.pop_back();
+    return t;
+  }
+
+  task *steal() {
+    std::lock_guard<std::mutex> lk(m_);
+    if (dat_.empty()) return nullptr;
+    task *t = dat_.front();
+    dat_.pop_front();
+    return t;
+  }
+
+private:
+  std::deque<task*> dat_;
+  std::mutex m_;
+};
+
+template <typename = void>
+class scheduler_ {
+public:
+  // index of the worker running on this thread, -1 for other threads
+  static __thread int worker_index;
+};
+
+template <typename T>
+__thread int scheduler_<T>::worker_index = -1;
+
+// fixed-size work-stealing thread pool
+class scheduler : public scheduler_<> {
+public:
+  static scheduler &instance() {
+    static scheduler s;
+    return s;
+  }
+
+  ~scheduler() {
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+      threads_[i].join();
+  }
+
+  size_t size() const {
+    return deques_.size();
+  }
+
+  // workers sleeping for lack of tasks
+  size_t idle() const {
+    return sleepers_.load(std::memory_order_relaxed);
+  }
+
+  // tasks spawned and not yet taken by any thread
+  size_t queued() const {
+    int n = queued_.load(std::memory_order_relaxed);
+    return n > 0 ? n : 0;
+  }
+
+  // the scheduler holds a reference to t until it has run
+  void spawn(task *t) {
+    t->retain();
+    if (worker_index >= 0)
+      deques_[worker_index]->push(t);
+    else
+      inject_.push(t);
+    ++queued_;
+    if (sleepers_ > 0) {
+      std::lock_guard<std::mutex> lk(m_);
+      cv_.notify_one();
+    }
+  }
+
+  // Runs t here if nobody has started it yet, otherwise runs other tasks
+  // until t has finished. A task run here stays in its queue and is dropped
+  // when it is dequeued.
+  void wait(task *t) {
+    if (claim(t)) {
+      t->execute();
+      t->state_.store(task::finished, std::memory_order_release);
+      return;
+    }
+    while (!t->finished_p()) {
+      task *u = find_task();
+      if (u)
+        run(u);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  // Keeps t from running if nobody has started it yet; the scheduler
+  // drops it when it is dequeued. Returns false if t has started.
+  bool cancel(task *t) {
+    if (!claim(t)) return false;
+    t->state_.store(task::finished, std::memory_order_release);
+    return true;
+  }
+
+  // Runs other tasks until one of ts[0..n) has finished and returns its
+  // index, or n if n is 0. This thread may run tasks of ts itself.
+  size_t wait_any(task *const *ts, size_t n) {
+    if (n == 0) return 0;
+    for (;;) {
+      for (size_t i = 0; i < n; ++i)
+        if (ts[i]->finished_p()) return i;
+      task *u = find_task();
+      if (u)
+        run(u);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+private:
+  scheduler()
+    : queued_(0)
+    , sleepers_(0)
+    , stop_(false) {
+    size_t n = std::thread::hardware_concurrency();
+    // values that are not a positive number are ignored
+    if (const char *env = std::getenv("CONCURRENT_REVISIONS_THREADS")) {
+      char *end;
+      long v = std::strtol(env, &end, 10);
+      if (end != env && *end == '\0' && v > 0)
+        n = v;
+    }
+    if (n == 0) n = 1;
+    for (size_t i = 0; i < n; ++i)
+      deques_.push_back(std::unique_ptr<task_deque>(new task_deque()));
+    for (size_t i = 0; i < n; ++i)
+      threads_.push_back(std::thread(&scheduler::worker_loop, this, (int)i));
+  }
+
+  scheduler(const scheduler &);
+  scheduler &operator=(const scheduler &);
+
+  void worker_loop(int ix) {
+    worker_index = ix;
+    for (;;) {
+      task *t = find_task();
+      if (t) {
+        run(t);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lk(m_);
+      ++sleepers_;
+      while (queued_ == 0 && !stop_)
+        cv_.wait_for(lk, std::chrono::milliseconds(10));
+      --sleepers_;
+      if (stop_) return;
+    }
+  }
+
+  task *find_task() {
+    task *t = nullptr;
+    int self = worker_index;
+    if (self >= 0)
+      t = deques_[self]->pop();
+    if (!t)
+      t = inject_.steal();
+    for (size_t i = 1; !t && i <= deques_.size(); ++i) {
+      size_t victim = (self + i) % deques_.size();
+      if ((int)victim != self)
+        t = deques_[victim]->steal();
+    }
+    if (t) --queued_;
+    return t;
+  }
+
+  // only one thread can move a task from pending to running
+  static bool claim(task *t) {
+    int expected = task::pending;
+    return t->state_.load(std::memory_order_relaxed) == task::pending &&
+      t->state_.compare_exchange_strong(expected, task::running, std::memory_order_acquire);
+  }
+
+  void run(task *t) {
+    if (claim(t)) {
+      t->execute();
+      t->state_.store(task::finished, std::memory_order_release);
+    }
+    t->release();
+  }
+
+  std::vector<std::unique_ptr<task_deque> > deques_;
+  task_deque inject_;
+  std::vector<std::thread> threads_;
+
+  std::atomic_int queued_;
+  std::atomic_int sleepers_;
+  bool stop_;
+  std::mutex m_;
+  std::condition_variable cv_;
+};
+
+} // namespace detail
+} // namespace concurrent_revisions
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+#include "stats.h"
+
+namespace concurrent_revisions {
+namespace detail {
+
+// Test-and-test-and-set lock for short critical sections. Acquiring it is
+// a single atomic exchange and releasing it a plain store.
+class spinlock {
+public:
+  spinlock() : locked_(false) {}
+
+  void lock() {
+    if (!locked_.exchange(true, std::memory_order_acquire))
+      return;
+    count(stat_intmap_lock_waits);
+    do {
+      while (locked_.load(std::memory_order_relaxed))
+        std::this_thread::yield();
+    } while (locked_.exchange(true, std::memory_order_acquire));
+  }
+
+  bool try_lock() {
+    return !locked_.load(std::memory_order_relaxed) &&
+      !locked_.exchange(true, std::memory_order_acquire);
+  }
+
+  void unlock() {
+    locked_.store(false, std::memory_order_release);
+  }
+
+private:
+  spinlock(const spinlock &);
+  spinlock &operator=(const spinlock &);
+
+  std::atomic_bool locked_;
+};
+
+} // namespace detail
+} // namespace concurrent_revisions
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace concurrent_revisions {
+
+// Counters of the revision engine, summed over all threads.
+//
+// They are only kept when CONCURRENT_REVISIONS_STATS is defined; each
+// thread then bumps its own counters without synchronization, and
+// snapshot() adds them up. Otherwise counting compiles to nothing and
+// every counter reads zero.
+struct revision_stats {
+  uint64_t forks;
+  // join and lazy_join
+  uint64_t joins;
+  uint64_t aborts;
+  uint64_t segments_created;
+  uint64_t segments_released;
+  // parent links followed by reads looking for a variable's version
+  uint64_t chain_hops;
+  uint64_t intmap_lookups;
+  // intmap writes that found the map's lock taken
+  uint64_t intmap_lock_waits;
+  // variables a join wrote a merged value to
+  uint64_t merges;
+  // variables whose value a collapse moved to the current segment
+  uint64_t collapses;
+  uint64_t versions_created;
+  uint64_t versions_erased;
+  // sizeof(T) for every value stored by set, merge and collapse
+  uint64_t bytes_copied;
+
+  uint64_t segments_live() const {
+    return segments_created - segments_released;
+  }
+
+  uint64_t versions_live() const {
+    return versions_created - versions_erased;
+  }
+
+  // the counters since earlier
+  revision_stats operator-(const revision_stats &earlier) const {
+    revision_stats d;
+    for (int i = 0; i < count; ++i)
+      d.at(i) = at(i) - earlier.at(i);
+    return d;
+  }
+
+  static revision_stats snapshot();
+
+  static const int count = 13;
+
+  uint64_t &at(int i) {
+    return (&forks)[i];
+  }
+
+  uint64_t at(int i) const {
+    return (&forks)[i];
+  }
+};
+
+static_assert(sizeof(revision_stats) == revision_stats::count * sizeof(uint64_t),
+              "revision_stats must hold only its counters");
+
+namespace detail {
+
+enum stat {
+  stat_forks,
+  stat_joins,
+  stat_aborts,
+  stat_segments_created,
+  stat_segments_released,
+  stat_chain_hops,
+  stat_intmap_lookups,
+  stat_intmap_lock_waits,
+  stat_merges,
+  stat_collapses,
+  stat_versions_created,
+  stat_versions_erased,
+  stat_bytes_copied
+};
+
+#ifdef CONCURRENT_REVISIONS_STATS
+
+// The counters of one thread. Only the owner writes them, so a bump is a
+// relaxed load and store.
+struct stat_block {
+  stat_block() {
+    for (int i = 0; i < revision_stats::count; ++i)
+      v[i].store(0, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> v[revision_stats::count];
+};
+
+// the blocks of live threads and the sums of finished ones
+class stat_registry {
+public:
+  static stat_registry &instance() {
+    static stat_registry r;
+    return r;
+  }
+
+  void add(stat_block *b) {
+    std::lock_guard<std::mutex> lk(m_);
+    blocks_.push_back(b);
+  }
+
+  void remove(stat_block *b) {
+    std::lock_guard<std::mutex> lk(m_);
+    for (int i = 0; i < revision_stats::count; ++i)
+      retired_.at(i) += b->v[i].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      if (blocks_[i] == b) {
+        blocks_.erase(blocks_.begin() + i);
+        break;
+      }
+    }
+  }
+
+  revision_stats sum() {
+    std::lock_guard<std::mutex> lk(m_);
+    revision_stats s = retired_;
+    for (size_t i = 0; i < blocks_.size(); ++i)
+      for (int j = 0; j < revision_stats::count; ++j)
+        s.at(j) += blocks_[i]->v[j].load(std::memory_order_relaxed);
+    return s;
+  }
+
+private:
+  stat_registry()
+    : retired_() {}
+
+  std::mutex m_;
+  std::vector<stat_block*> blocks_;
+  revision_stats retired_;
+};
+
+class thread_stats {
+public:
+  thread_stats() {
+    stat_registry::instance().add(&block_);
+  }
+
+  ~thread_stats() {
+    stat_registry::instance().remove(&block_);
+  }
+
+  static stat_block &local() {
+    static thread_local thread_stats s;
+    return s.block_;
+  }
+
+private:
+  stat_block block_;
+};
+
+inline void count(stat s, uint64_t n = 1)
+{
+  std::atomic<uint64_t> &c = thread_stats::local().v[s];
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Sets up the thread's counters now, so that thread_local objects created
+// afterwards can still count in their destructors.
+inline void attach_stats()
+{
+  thread_stats::local();
+}
+
+#else
+
+inline void count(stat, uint64_t = 1)
+{
+}
+
+inline void attach_stats()
+{
+}
+
+#endif
+
+} // namespace detail
+
+inline revision_stats revision_stats::snapshot()
+{
+#ifdef CONCURRENT_REVISIONS_STATS
+  return detail::stat_registry::instance().sum();
+#else
+  return revision_stats();
+#endif
+}
+
+} // namespace concurrent_revisions
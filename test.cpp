@@ -1,7 +1,15 @@
 #include "concurrent_revisions.h"
 #include "util.h"
+#include "versioned_array.h"
+#include "versioned_map.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include <iostream>
 #include <deque>
+#include <fstream>
+#include <numeric>
+#include <sstream>
 #include <vector>
 #include <gtest/gtest.h>
 
@@ -207,6 +215,789 @@ TEST(gtest, add_merger)
   EXPECT_EQ(110, x);
 }
 
+TEST(gtest, read_cache)
+{
+  versioned<int> x;
+  x = 1;
+
+  int sum = 0;
+  for (int i = 0; i < 100; ++i)
+    sum += x;
+  EXPECT_EQ(100, sum);
+
+  revision r = fork([&] {
+      EXPECT_EQ(1, x);
+      x = 2;
+      EXPECT_EQ(2, x);
+    });
+  EXPECT_EQ(1, x);
+  join(r);
+  EXPECT_EQ(2, x);
+  x = 3;
+  EXPECT_EQ(3, x);
+
+  for (int i = 0; i < 100; ++i) {
+    versioned<int> y;
+    EXPECT_EQ(0, y);
+    y = i;
+    EXPECT_EQ(i, y);
+  }
+}
+
+TEST(gtest, recycle)
+{
+  versioned<int, add_merger<int> > x;
+  for (int i = 0; i < 1000; ++i) {
+    revision r = fork([&] {
+        x = x + 1;
+      });
+    revision copy = r;
+    r = revision();
+    join(copy);
+  }
+  EXPECT_EQ(1000, x);
+}
+
+TEST(gtest, recycle_thread_exit)
+{
+  typedef detail_::object_pool_<segment> pool;
+  versioned<int, add_merger<int> > x;
+  auto run = [&] {
+    std::thread t([&] {
+        for (int i = 0; i < 10; ++i) {
+          revision r = fork([&] { x = x + 1; });
+          join(r);
+        }
+      });
+    t.join();
+  };
+
+  run();
+  size_t slabs;
+  {
+    std::lock_guard<std::mutex> lk(pool::global_m_);
+    slabs = pool::slabs_->size();
+  }
+  for (int i = 0; i < 100; ++i)
+    run();
+  std::lock_guard<std::mutex> lk(pool::global_m_);
+  // exited threads hand their segments on instead of leaking a slab each
+  EXPECT_LE(pool::slabs_->size(), slabs + 2);
+}
+
+TEST(gtest, handles)
+{
+  versioned<int> *x = new versioned<int>;
+  *x = 1;
+  versioned<int> y(*x);
+  delete x;
+  EXPECT_EQ(1, y);
+
+  revision r = fork([&] {
+      versioned<int> z(y);
+      z = 2;
+      versioned<int> local;
+      local = 3;
+    });
+  EXPECT_EQ(1, y);
+  join(r);
+  EXPECT_EQ(2, y);
+}
+
+TEST(gtest, intmap)
+{
+  concurrent_intmap<std::string> m;
+  EXPECT_FALSE(m.has(1));
+  EXPECT_EQ(nullptr, m.find(1));
+
+  const std::string *p = &m.set(1, std::string("a"));
+  EXPECT_EQ("a", m.get(1));
+  // overwriting keeps the value in place
+  EXPECT_EQ(p, &m.set(1, std::string("b")));
+  EXPECT_EQ("b", *m.find(1));
+
+  bool inserted;
+  m.insert_or_assign(2, std::string("c"), inserted);
+  EXPECT_TRUE(inserted);
+  m.insert_or_assign(2, std::string("d"), inserted);
+  EXPECT_FALSE(inserted);
+  EXPECT_EQ("d", m.get(2));
+
+  // empty once the versions are gone, unless a reference is held
+  m.retain();
+  EXPECT_FALSE(m.erase(1));
+  EXPECT_FALSE(m.has(1));
+  EXPECT_FALSE(m.erase(2));
+  EXPECT_TRUE(m.release());
+  EXPECT_TRUE(m.erase(3));
+}
+
+// erased slots are reused and dropped by the next resize, and lookups
+// still find the keys probed past them
+TEST(gtest, intmap_tombstones)
+{
+  concurrent_intmap<int> m;
+  const int live = 5;
+  for (int i = 0; i < 100000; ++i) {
+    m.set(i, i);
+    if (i >= live) {
+      EXPECT_FALSE(m.erase(i - live));
+      EXPECT_FALSE(m.has(i - live));
+    }
+    for (int k = std::max(0, i - live + 1); k <= i; ++k) {
+      const int *v = m.find(k);
+      if (!v || *v != k) {
+        ADD_FAILURE() << "key " << k << " lost after inserting " << i;
+        return;
+      }
+    }
+  }
+  for (int k = 100000 - live; k < 100000; ++k)
+    EXPECT_EQ(k == 100000 - 1, m.erase(k));
+}
+
+// versions past 2^31 survive resizes
+TEST(gtest, intmap_wide_keys)
+{
+  concurrent_intmap<int> m;
+  const version_t base = (version_t(1) << 31) - 20;
+  for (int i = 0; i < 40; ++i)
+    m.set(base + i, i);
+  for (int i = 0; i < 1000; ++i)
+    m.set(i, -i);
+  for (int i = 0; i < 40; ++i)
+    EXPECT_EQ(i, m.get(base + i));
+  m.set(version_t(1) << 40, 7);
+  EXPECT_EQ(7, m.get(version_t(1) << 40));
+  EXPECT_FALSE(m.has(base - 1));
+}
+
+// Writers insert under the map's lock, growing the table, while readers
+// look up the keys already published without taking it.
+TEST(gtest, intmap_concurrent_grow)
+{
+  const int writers = 2, readers = 2, n = 20000;
+  concurrent_intmap<int> m;
+  std::atomic<int> published[writers];
+  std::atomic<int> wrong(0);
+  std::atomic<bool> done(false);
+  for (int w = 0; w < writers; ++w)
+    published[w] = 0;
+
+  vector<std::thread> ts;
+  for (int w = 0; w < writers; ++w) {
+    ts.push_back(std::thread([&, w] {
+          for (int i = 0; i < n; ++i) {
+            int k = i * writers + w;
+            m.set(k, -k);
+            published[w].store(i + 1, std::memory_order_release);
+          }
+        }));
+  }
+  for (int r = 0; r < readers; ++r) {
+    ts.push_back(std::thread([&, r] {
+          unsigned x = r + 1;
+          while (!done.load()) {
+            for (int w = 0; w < writers; ++w) {
+              int count = published[w].load(std::memory_order_acquire);
+              if (count == 0) continue;
+              x = x * 2654435761u + 1;
+              int k = (int)(x % count) * writers + w;
+              const int *v = m.find(k);
+              if (!v || *v != -k) ++wrong;
+            }
+          }
+        }));
+  }
+  for (int w = 0; w < writers; ++w)
+    ts[w].join();
+  done = true;
+  for (int r = 0; r < readers; ++r)
+    ts[writers + r].join();
+
+  EXPECT_EQ(0, (int)wrong);
+  for (int k = 0; k < n * writers; ++k)
+    ASSERT_EQ(-k, m.get(k));
+}
+
+TEST(gtest, write_sets)
+{
+  std::vector<versioned<int> > xs(100);
+  std::vector<versioned<double, add_merger<double> > > ys(100);
+  versioned<int, max_merger<int> > m;
+
+  revision r = fork([&] {
+      for (int i = 0; i < 100; ++i) {
+        xs[i] = i;
+        m = i;
+        ys[i] = ys[i] + 1.0;
+      }
+    });
+  for (int i = 0; i < 100; ++i)
+    ys[i] = ys[i] + 2.0;
+  join(r);
+
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, xs[i]);
+    EXPECT_EQ(3.0, ys[i]);
+  }
+  EXPECT_EQ(99, m);
+}
+
+TEST(gtest, lazy_join)
+{
+  versioned<int, add_merger<int> > sum;
+  versioned<int> x, y, z;
+
+  revision r1 = fork([&] {
+      sum = sum + 1;
+      x = 1;
+      y = 1;
+      z = 1;
+    });
+  revision r2 = fork([&] {
+      sum = sum + 10;
+      x = 2;
+    });
+  lazy_join(r1);
+  lazy_join(r2);
+
+  // merged in join order on first read
+  EXPECT_EQ(11, sum);
+  EXPECT_EQ(2, x);
+  // a write replaces the merged value
+  y = 5;
+  EXPECT_EQ(5, y);
+
+  // a fork sees all merges
+  revision r3 = fork([&] {
+      EXPECT_EQ(1, z);
+      sum = sum + 100;
+    });
+  join(r3);
+  EXPECT_EQ(111, sum);
+  EXPECT_EQ(5, y);
+}
+
+// segment versions keep counting past 2^31
+TEST(gtest, version_wraparound)
+{
+  std::atomic<version_t> &count = detail_::segment_<>::version_count_;
+  version_t wrap = version_t(1) << 31;
+  if (count < wrap - 100) count = wrap - 100;
+  versioned<int, add_merger<int> > sum;
+  versioned<int> last;
+  versioned_array<int> a(10);
+  for (int i = 0; i < 200; ++i) {
+    revision r = fork([&, i] {
+        sum = sum + 1;
+        last = i;
+        a.set(i % 10, i);
+      });
+    join(r);
+  }
+  EXPECT_GT(count, wrap);
+  EXPECT_EQ(200, sum);
+  EXPECT_EQ(199, last);
+  for (int k = 0; k < 10; ++k)
+    EXPECT_EQ(190 + k, a[k]);
+}
+
+// reads resolving many pending merges keep earlier references valid
+TEST(gtest, lazy_join_reference)
+{
+  versioned<std::string> s;
+  s = std::string(100, 'a');
+  // more variables than pending_limit
+  vector<versioned<int> > xs(256);
+  revision r = fork([&] {
+      for (size_t i = 0; i < xs.size(); ++i)
+        xs[i] = (int)i;
+    });
+  lazy_join(r);
+  const std::string &ref = s;
+  for (size_t i = 0; i < xs.size(); ++i)
+    EXPECT_EQ((int)i, xs[i]);
+  EXPECT_EQ(std::string(100, 'a'), ref);
+}
+
+TEST(gtest, cumulative)
+{
+  cumulative<int> sum;
+  cumulative<int, max_merger<int> > hi;
+  cumulative<int, min_merger<int> > lo;
+  lo = 1000;
+
+  std::vector<revision> rs;
+  for (int t = 0; t < 8; ++t) {
+    rs.push_back(fork([&, t] {
+          for (int i = 0; i < 100; ++i) {
+            sum += 1;
+            hi.combine(t * 100 + i);
+            lo.combine(t * 100 + i);
+          }
+          EXPECT_EQ(100, sum);
+        }));
+  }
+  sum += 1000;
+  EXPECT_EQ(1000, sum);
+  for (size_t i = 0; i < rs.size(); ++i)
+    join(rs[i]);
+
+  EXPECT_EQ(1800, sum);
+  EXPECT_EQ(799, hi);
+  EXPECT_EQ(0, lo);
+}
+
+static void nested_fork(int depth, cumulative<int> &count)
+{
+  count += 1;
+  if (depth == 0) return;
+  revision r = fork([&] { nested_fork(depth - 1, count); });
+  join(r);
+}
+
+TEST(gtest, nested_join)
+{
+  cumulative<int> count;
+  nested_fork(1000, count);
+  EXPECT_EQ(1001, count);
+}
+
+TEST(gtest, versioned_array)
+{
+  versioned_array<int> a(100000);
+  EXPECT_EQ(0, a[5]);
+
+  vector<int> ix(a.size());
+  iota(ix.begin(), ix.end(), 0);
+  parallel_foreach(ix.begin(), ix.end(), [&](int i){ a.set(i, i * 2); });
+  for (size_t i = 0; i < a.size(); ++i)
+    ASSERT_EQ(int(i * 2), a[i]);
+
+  // writes to different elements of one chunk are both kept
+  revision r = fork([&] {
+      a.set(1, -1);
+      EXPECT_EQ(4, a[2]);
+    });
+  a.set(2, -2);
+  EXPECT_EQ(2, a[1]);
+  join(r);
+  EXPECT_EQ(-1, a[1]);
+  EXPECT_EQ(-2, a[2]);
+  EXPECT_EQ(6, a[3]);
+
+  versioned_array<int, add_merger<int>, 16> counts(64);
+  vector<revision> rs;
+  for (int t = 0; t < 4; ++t) {
+    rs.push_back(fork([&] {
+          for (int i = 0; i < 64; ++i)
+            counts.set(i, counts[i] + 1);
+        }));
+  }
+  counts.set(0, counts[0] + 10);
+  for (size_t i = 0; i < rs.size(); ++i)
+    join(rs[i]);
+  EXPECT_EQ(14, counts[0]);
+  EXPECT_EQ(4, counts[63]);
+}
+
+struct bad_hash {
+  size_t operator()(int k) const { return k % 7; }
+};
+
+TEST(gtest, versioned_map)
+{
+  versioned_map<int, int> m;
+  for (int i = 0; i < 10000; ++i)
+    m.set(i, i);
+  EXPECT_EQ(10000u, m.size());
+  EXPECT_EQ(1234, *m.find(1234));
+  EXPECT_EQ(nullptr, m.find(10000));
+
+  revision r = fork([&] {
+      m.set(1, -1);
+      m.set(20000, 1);
+      m.erase(3);
+      EXPECT_EQ(2, *m.find(2));
+    });
+  m.set(2, -2);
+  m.erase(4);
+  EXPECT_EQ(1, *m.find(1));
+  join(r);
+
+  EXPECT_EQ(-1, *m.find(1));
+  EXPECT_EQ(-2, *m.find(2));
+  EXPECT_EQ(nullptr, m.find(3));
+  EXPECT_EQ(nullptr, m.find(4));
+  EXPECT_EQ(1, *m.find(20000));
+  EXPECT_EQ(9999u, m.size());
+
+  int sum = 0;
+  m.for_each([&](int k, int v) { sum += k == v; });
+  EXPECT_EQ(9996, sum);
+
+  // per-key merge, with colliding hashes
+  versioned_map<int, int, add_merger<int>, bad_hash> counts;
+  vector<revision> rs;
+  for (int t = 0; t < 4; ++t) {
+    rs.push_back(fork([&] {
+          for (int i = 0; i < 100; ++i) {
+            const int *c = counts.find(i);
+            counts.set(i, (c ? *c : 0) + 1);
+          }
+        }));
+  }
+  counts.set(0, 10);
+  for (size_t i = 0; i < rs.size(); ++i)
+    join(rs[i]);
+  EXPECT_EQ(100u, counts.size());
+  EXPECT_EQ(14, *counts.find(0));
+  EXPECT_EQ(4, *counts.find(99));
+  for (int i = 0; i < 100; i += 2)
+    counts.erase(i);
+  EXPECT_EQ(50u, counts.size());
+  EXPECT_EQ(4, *counts.find(51));
+}
+
+struct counted {
+  static int copies;
+  vector<int> v;
+  counted() {}
+  counted(size_t n, int x) : v(n, x) {}
+  counted(const counted &r) : v(r.v) { ++copies; }
+  counted(counted &&r) : v(std::move(r.v)) {}
+  counted &operator=(const counted &r) { v = r.v; ++copies; return *this; }
+  counted &operator=(counted &&r) { v = std::move(r.v); return *this; }
+};
+int counted::copies = 0;
+
+TEST(gtest, update)
+{
+  versioned<counted> x;
+  x.emplace(1000, 1);
+  counted::copies = 0;
+  x = counted(1000, 2);
+  EXPECT_EQ(0, counted::copies);
+
+  for (int i = 0; i < 1000; ++i)
+    x.update([&](counted &c) { c.v[i] += i; });
+  EXPECT_EQ(0, counted::copies);
+  EXPECT_EQ(2 + 999, static_cast<const counted&>(x).v[999]);
+
+  revision r = fork([&] {
+      x.update([](counted &c) { c.v[0] = -1; });
+      x.update([](counted &c) { c.v[1] = -1; });
+    });
+  join(r);
+  const counted &c = x;
+  EXPECT_EQ(-1, c.v[0]);
+  EXPECT_EQ(-1, c.v[1]);
+  EXPECT_EQ(4, c.v[2]);
+
+  versioned<std::string> s;
+  s.emplace(3, 'a');
+  s.update([](std::string &t) { t += "b"; });
+  EXPECT_EQ("aaab", static_cast<const std::string&>(s));
+}
+
+TEST(gtest, join_all)
+{
+  const int n = 100, vars = 200;
+  vector<versioned<int, add_merger<int> > > sums(vars);
+  vector<versioned<int> > last(vars);
+  vector<revision> rs;
+  for (int t = 0; t < n; ++t) {
+    rs.push_back(fork([&, t] {
+          for (int i = 0; i < vars; ++i) {
+            sums[i] = sums[i] + t;
+            if ((t + i) % 3 == 0)
+              last[i] = t;
+          }
+        }));
+  }
+  for (int i = 0; i < vars; ++i)
+    sums[i] = sums[i] + 1;
+  join_all(rs);
+
+  for (int i = 0; i < vars; ++i) {
+    EXPECT_EQ(1 + n * (n - 1) / 2, sums[i]);
+    int expect = 0;
+    for (int t = 0; t < n; ++t)
+      if ((t + i) % 3 == 0) expect = t;
+    EXPECT_EQ(expect, last[i]);
+  }
+}
+
+// large enough for collapse to be split among the worker threads
+TEST(gtest, large_collapse)
+{
+  const int vars = 3 * concurrent_revisions::detail::parallel_merge_grain;
+  vector<versioned<int> > xs(vars);
+  revision r = fork([&] {
+      for (int i = 0; i < vars; ++i)
+        xs[i] = i;
+      revision c = fork([&] {
+          for (int i = 0; i < vars; i += 2)
+            xs[i] = -i;
+        });
+      for (int i = 1; i < vars; i += 4)
+        xs[i] = 2 * i;
+      // the segment written before the fork is collapsed here
+      join(c);
+      for (int i = 0; i < vars; ++i) {
+        int expect = i % 2 == 0 ? -i : i % 4 == 1 ? 2 * i : i;
+        if (xs[i] != expect) {
+          ADD_FAILURE() << "xs[" << i << "] = " << xs[i];
+          break;
+        }
+      }
+    });
+  join(r);
+
+  for (int i = 0; i < vars; ++i)
+    EXPECT_EQ(i % 2 == 0 ? -i : i % 4 == 1 ? 2 * i : i, xs[i]);
+}
+
+TEST(gtest, abort)
+{
+  versioned<int> x;
+  x = 1;
+  vector<versioned<int> > ys(1000);
+
+  // aborted writes are never merged
+  revision r = fork([&] {
+      x = 2;
+      for (size_t i = 0; i < ys.size(); ++i) ys[i] = 3;
+    });
+  abort(r);
+  EXPECT_EQ(1, x);
+  EXPECT_EQ(0, ys[0]);
+
+  // a revision that runs until it is cancelled
+  revision s = fork([&] {
+      auto start = std::chrono::steady_clock::now();
+      while (!cancelled() && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+        std::this_thread::yield();
+      x = cancelled() ? 3 : 4;
+    });
+  abort(s);
+  EXPECT_EQ(1, x);
+  EXPECT_FALSE(cancelled());
+
+  // the fast revision is listed first, in case this thread runs it itself
+  vector<revision> rs;
+  rs.push_back(fork([&] { x = 5; }));
+  rs.push_back(fork([&] {
+        auto start = std::chrono::steady_clock::now();
+        while (!cancelled() && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+          std::this_thread::yield();
+        x = 6;
+      }));
+  EXPECT_EQ(0U, join_first(rs));
+  EXPECT_EQ(5, x);
+}
+
+TEST(gtest, join_first_empty)
+{
+  vector<revision> rs;
+  EXPECT_EQ(0U, join_first(rs));
+}
+
+// Each running loser waits for the others to see cancelled() too, which
+// they only do in time if join_first cancels them all before waiting.
+TEST(gtest, join_first_cancels_all)
+{
+  std::atomic<int> started(0), stopped(0), late(0);
+  vector<revision> rs;
+  rs.push_back(fork([] {}));
+  for (int i = 0; i < 3; ++i) {
+    rs.push_back(fork([&] {
+          ++started;
+          auto start = std::chrono::steady_clock::now();
+          while (!cancelled() && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+            std::this_thread::yield();
+          ++stopped;
+          start = std::chrono::steady_clock::now();
+          while (stopped < started) {
+            if (std::chrono::steady_clock::now() - start > std::chrono::seconds(2)) {
+              ++late;
+              break;
+            }
+            std::this_thread::yield();
+          }
+        }));
+  }
+  EXPECT_EQ(0U, join_first(rs));
+  EXPECT_EQ(0, (int)late);
+}
+
+// Revisions are always outstanding, so collapse never reaches the old
+// segments of the chain; compaction keeps it short.
+TEST(gtest, bounded_chain)
+{
+  const int n = 4000, window = 4;
+  versioned<int> x, z;
+  z = -1;
+  vector<versioned<int> > ys(16);
+  deque<revision> rs;
+  std::atomic<int> wrong(0);
+  revision_stats before = revision_stats::snapshot();
+  for (int i = 0; i < n; ++i) {
+    x = i;
+    ys[i % ys.size()] = i;
+    rs.push_back(fork([&, i] {
+          const int &v = x;
+          int y = ys[(i + 1) % ys.size()];
+          if (z != -1) ++wrong;
+          std::this_thread::yield();
+          // the revision that wrote it last has been joined
+          int expect = i + 1 < (int)ys.size() ? 0 : -(i + 1 - (int)ys.size());
+          if (v != i || x != i || y != expect)
+            ++wrong;
+          ys[i % ys.size()] = -i;
+        }));
+    if (rs.size() > window) {
+      join(rs.front());
+      rs.pop_front();
+    }
+  }
+  while (!rs.empty()) {
+    join(rs.front());
+    rs.pop_front();
+  }
+  EXPECT_EQ(0, (int)wrong);
+  EXPECT_EQ(n - 1, x);
+  for (int k = 0; k < (int)ys.size(); ++k)
+    EXPECT_EQ(-(n - (int)ys.size() + k), ys[k]);
+  revision_stats d = revision_stats::snapshot() - before;
+#ifdef CONCURRENT_REVISIONS_STATS
+  // without compaction reading z walks all the segments written so far
+  EXPECT_LT(d.chain_hops, 200U * n);
+  EXPECT_LT(revision_stats::snapshot().segments_live(), 200U);
+#else
+  (void)d;
+#endif
+}
+
+TEST(gtest, stats)
+{
+  versioned<int> x;
+  x = 0;
+  revision_stats before = revision_stats::snapshot();
+  revision r = fork([&]{ x = 1; });
+  join(r);
+  EXPECT_EQ(1, (int)x);
+  revision_stats d = revision_stats::snapshot() - before;
+#ifdef CONCURRENT_REVISIONS_STATS
+  EXPECT_EQ(1U, d.forks);
+  EXPECT_EQ(1U, d.joins);
+  EXPECT_EQ(2U, d.segments_created);
+  EXPECT_EQ(1U, d.merges);
+  EXPECT_GE(d.intmap_lookups, 1U);
+  EXPECT_GE(d.bytes_copied, 2 * sizeof(int));
+#else
+  for (int i = 0; i < revision_stats::count; ++i)
+    EXPECT_EQ(0U, d.at(i));
+#endif
+}
+
+TEST(gtest, trace)
+{
+  clear_trace();
+  versioned<int> x;
+  x = 0;
+  revision r = fork([&]{ x = 1; });
+  join(r);
+  std::ostringstream os;
+  write_trace(os);
+  string t = os.str();
+  EXPECT_EQ(0U, t.find("{\"traceEvents\":["));
+#ifdef CONCURRENT_REVISIONS_TRACE
+  EXPECT_NE(string::npos, t.find("\"name\":\"fork\""));
+  EXPECT_NE(string::npos, t.find("\"name\":\"revision\",\"ph\":\"X\""));
+  EXPECT_NE(string::npos, t.find("\"name\":\"join\""));
+  EXPECT_NE(string::npos, t.find("\"name\":\"merge\""));
+  EXPECT_NE(string::npos, t.find("\"ph\":\"s\""));
+  EXPECT_NE(string::npos, t.find("\"ph\":\"f\""));
+#else
+  EXPECT_EQ("{\"traceEvents\":[\n]}\n", t);
+#endif
+}
+
+TEST(gtest, profile)
+{
+  clear_profile();
+  versioned<int> x;
+  x.name("profile x");
+  cumulative<int> sum;
+  sum.name(CONCURRENT_REVISIONS_HERE);
+  x = 0;
+  revision r1 = fork([&]{ x = 1; sum += 1; });
+  revision r2 = fork([&]{ x = 2; sum += 1; });
+  join(r1);
+  join(r2);
+  EXPECT_EQ(2, (int)x);
+  EXPECT_EQ(2, (int)sum);
+
+  std::vector<variable_profile> r = profile_report(std::size_t(-1));
+#ifdef CONCURRENT_REVISIONS_PROFILE
+  std::size_t ix = r.size(), is = r.size();
+  for (std::size_t i = 0; i < r.size(); ++i) {
+    if (r[i].name == "profile x") ix = i;
+    if (r[i].name.find("test.cpp:") != string::npos) is = i;
+  }
+  ASSERT_LT(ix, r.size());
+  ASSERT_LT(is, r.size());
+  EXPECT_LT(ix, is);
+  EXPECT_EQ(1U, r[ix].variables);
+  EXPECT_EQ(3U, r[ix].writes);
+  EXPECT_EQ(2U, r[ix].merges);
+  // r2 forked before r1's value of x was merged
+  EXPECT_EQ(1U, r[ix].conflicts);
+  EXPECT_EQ(1U, r[ix].discarded);
+  EXPECT_EQ(2U, r[is].writes);
+  EXPECT_EQ(2U, r[is].merges);
+  EXPECT_EQ(1U, r[is].conflicts);
+  EXPECT_EQ(0U, r[is].discarded);
+#else
+  EXPECT_TRUE(r.empty());
+#endif
+}
+
+#ifdef __linux__
+static long resident_kb()
+{
+  std::ifstream statm("/proc/self/statm");
+  long size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * 4;
+}
+
+TEST(gtest, soak)
+{
+  const int cycles = 1000000;
+  versioned<int, add_merger<int> > total;
+  long warm = 0;
+
+  for (int i = 0; i < cycles; ++i) {
+    versioned<int> request;
+    request = i;
+    revision r = fork([&] {
+        total = total + 1;
+        request = request + 1;
+      });
+    join(r);
+    EXPECT_EQ(i + 1, request);
+    if (i == cycles / 10)
+      warm = resident_kb();
+  }
+
+  EXPECT_EQ(cycles, total);
+  EXPECT_LT(resident_kb() - warm, 1024);
+}
+#endif
+
 template <class Iterator>
 void parallel_sum(Iterator p, Iterator q, versioned<int, add_merger<int> > &sum)
 {
@@ -301,6 +1092,78 @@ TEST(gtest, parallel_stable_sort)
     EXPECT_EQ(i, v[i]);
 }
 
+// merges split down to single elements
+TEST(gtest, parallel_stable_sort_tiny)
+{
+  for (int n = 0; n <= 16; ++n) {
+    vector<int> v(n);
+    for (int i = 0; i < n; ++i)
+      v[i] = (i * 7) % 5;
+    vector<int> expect = v;
+    std::sort(expect.begin(), expect.end());
+    parallel_stable_sort(v.begin(), v.end(), std::less<int>(), 1);
+    EXPECT_EQ(expect, v);
+  }
+}
+
+// a value without a default constructor
+struct boxed {
+  explicit boxed(int v) : v(v) {}
+  bool operator<(const boxed &o) const { return v < o.v; }
+  int v;
+};
+
+TEST(gtest, parallel_stable_sort_no_default)
+{
+  vector<boxed> v;
+  for (int i = 0; i < 1000; ++i)
+    v.push_back(boxed((i * 37) % 1000));
+
+  parallel_stable_sort(v.begin(), v.end(), std::less<boxed>(), 10);
+  for (int i = 0; i < 1000; ++i)
+    EXPECT_EQ(i, v[i].v);
+}
+
+TEST(gtest, parallel_stable_sort_stability)
+{
+  // sorted by key only; the index records the original order
+  vector<std::pair<int, int> > v(100000);
+  for (std::size_t i = 0; i < v.size(); ++i)
+    v[i] = std::make_pair(rand() % 100, (int)i);
+
+  parallel_stable_sort(v.begin(), v.end(), [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+      return a.first < b.first;
+    });
+  for (std::size_t i = 1; i < v.size(); ++i)
+    ASSERT_TRUE(v[i - 1] < v[i]);
+}
+
+TEST(gtest, parallel_sort)
+{
+  vector<int> v(100000);
+  for (std::size_t i = 0; i < v.size(); ++i)
+    v[i] = rand() % (i % 2 ? 10 : 1000000);
+  vector<int> expect = v;
+  std::sort(expect.begin(), expect.end());
+
+  parallel_sort(v.begin(), v.end());
+  EXPECT_TRUE(expect == v);
+
+  parallel_sort(v.begin(), v.end(), std::greater<int>());
+  EXPECT_TRUE(std::equal(expect.rbegin(), expect.rend(), v.begin()));
+
+  // sorted and reversed input of distinct keys
+  v.resize(1000000);
+  iota(v.begin(), v.end(), 0);
+  expect = v;
+  parallel_sort(v.begin(), v.end());
+  EXPECT_TRUE(expect == v);
+  parallel_sort(v.begin(), v.end(), std::greater<int>());
+  EXPECT_TRUE(std::equal(expect.rbegin(), expect.rend(), v.begin()));
+  parallel_sort(v.begin(), v.end());
+  EXPECT_TRUE(expect == v);
+}
+
 TEST(gtest, parallel_swap_ranges)
 {
   vector<std::size_t> v(10000);
@@ -316,3 +1179,74 @@ TEST(gtest, parallel_swap_ranges)
   for (std::size_t i = 0; i < d.size(); ++i)
     EXPECT_EQ(i, d[i]);
 }
+
+TEST(gtest, parallel_reduce)
+{
+  vector<int> v(100000);
+  iota(v.begin(), v.end(), 0);
+
+  EXPECT_EQ(std::accumulate(v.begin(), v.end(), 7LL), parallel_reduce(v.begin(), v.end(), 7LL));
+  EXPECT_EQ(7, parallel_reduce(v.begin(), v.begin(), 7));
+
+  // op needs only be associative: concatenation keeps the order
+  vector<std::string> s(3000);
+  for (std::size_t i = 0; i < s.size(); ++i)
+    s[i] = std::string(1, 'a' + i % 26);
+  EXPECT_EQ(std::accumulate(s.begin(), s.end(), std::string(">")),
+            parallel_reduce(s.begin(), s.end(), std::string(">"), std::plus<std::string>(), 100));
+
+  vector<boxed> b;
+  for (int i = 0; i < 1000; ++i)
+    b.push_back(boxed(i));
+  boxed m = parallel_reduce(b.begin(), b.end(), boxed(-1), [](const boxed &x, const boxed &y) {
+      return x < y ? y : x;
+    }, 10);
+  EXPECT_EQ(999, m.v);
+}
+
+TEST(gtest, parallel_find_if)
+{
+  vector<int> v(1000000);
+  iota(v.begin(), v.end(), 0);
+
+  // the leftmost of several matches
+  auto it = parallel_find_if(v.begin(), v.end(), [](int x) { return x % 300000 == 299999; });
+  EXPECT_EQ(299999, *it);
+  EXPECT_TRUE(parallel_find_if(v.begin(), v.end(), [](int x) { return x < 0; }) == v.end());
+  EXPECT_TRUE(parallel_find_if(v.begin(), v.begin(), [](int) { return true; }) == v.begin());
+
+  EXPECT_TRUE(parallel_any_of(v.begin(), v.end(), [](int x) { return x == 123456; }));
+  EXPECT_FALSE(parallel_any_of(v.begin(), v.end(), [](int x) { return x < 0; }));
+  EXPECT_TRUE(parallel_none_of(v.begin(), v.end(), [](int x) { return x < 0; }));
+  EXPECT_TRUE(parallel_all_of(v.begin(), v.end(), [](int x) { return x >= 0; }));
+  EXPECT_FALSE(parallel_all_of(v.begin(), v.end(), [](int x) { return x != 999999; }));
+
+  // a hit near the front stops the rest of the search; how much of the
+  // rest other threads test before that depends on scheduling
+  std::atomic<int> tested(0);
+  it = parallel_find_if(v.begin(), v.end(), [&](int x) { ++tested; return x == 1000; });
+  EXPECT_EQ(1000, *it);
+  EXPECT_LT(tested, (int)v.size());
+}
+
+TEST(gtest, parallel_scan)
+{
+  vector<int> v(100000);
+  for (std::size_t i = 0; i < v.size(); ++i)
+    v[i] = rand() % 100;
+  vector<int> expect(v.size());
+  std::partial_sum(v.begin(), v.end(), expect.begin());
+
+  vector<int> out(v.size());
+  EXPECT_TRUE(parallel_inclusive_scan(v.begin(), v.end(), out.begin()) == out.end());
+  EXPECT_TRUE(expect == out);
+
+  EXPECT_TRUE(parallel_exclusive_scan(v.begin(), v.end(), out.begin(), 5) == out.end());
+  EXPECT_EQ(5, out[0]);
+  for (std::size_t i = 1; i < v.size(); ++i)
+    ASSERT_EQ(5 + expect[i - 1], out[i]);
+
+  // in place
+  parallel_inclusive_scan(v.begin(), v.end(), v.begin());
+  EXPECT_TRUE(expect == v);
+}
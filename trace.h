@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "scheduler.h"
+
+namespace concurrent_revisions {
+namespace detail {
+
+// One trace event. name and arg_name point to string literals.
+struct trace_event {
+  const char *name;
+  // Chrome trace phase: 'X' complete, 's' flow start, 'f' flow end
+  char phase;
+  // nanoseconds since the tracer started
+  uint64_t ts;
+  uint64_t dur;
+  // flow id for 's' and 'f'
+  uint64_t id;
+  const char *arg_name;
+  uint64_t arg;
+};
+
+const size_t trace_buffer_size = 1 << 16;
+
+// The events of one thread, newest trace_buffer_size kept. Only the owner
+// writes, so recording an event is a store and a release of the count.
+class trace_buffer {
+public:
+  trace_buffer(int tid, int worker)
+    : tid_(tid)
+    , worker_(worker)
+    , events_(trace_buffer_size)
+    , written_(0) {}
+
+  void push(const trace_event &e) {
+    uint64_t n = written_.load(std::memory_order_relaxed);
+    events_[n % trace_buffer_size] = e;
+    written_.store(n + 1, std::memory_order_release);
+  }
+
+  template <class F>
+  void for_each(F f) const {
+    uint64_t n = written_.load(std::memory_order_acquire);
+    uint64_t first = n > trace_buffer_size ? n - trace_buffer_size : 0;
+    for (uint64_t i = first; i < n; ++i)
+      f(events_[i % trace_buffer_size]);
+  }
+
+  void clear() {
+    written_.store(0, std::memory_order_release);
+  }
+
+  int tid_;
+  // scheduler worker index, -1 for other threads
+  int worker_;
+
+private:
+  std::vector<trace_event> events_;
+  std::atomic<uint64_t> written_;
+};
+
+#ifdef CONCURRENT_REVISIONS_TRACE
+
+// Owns the buffers of all threads that have recorded events, including
+// threads that have exited.
+class trace_registry {
+public:
+  static trace_registry &instance() {
+    static trace_registry r;
+    return r;
+  }
+
+  static trace_buffer &local() {
+    static thread_local trace_buffer *b = instance().add();
+    return *b;
+  }
+
+  uint64_t now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_).count();
+  }
+
+  template <class F>
+  void for_each_buffer(F f) {
+    std::lock_guard<std::mutex> lk(m_);
+    for (size_t i = 0; i < buffers_.size(); ++i)
+      f(*buffers_[i]);
+  }
+
+private:
+  trace_registry()
+    : start_(std::chrono::steady_clock::now()) {}
+
+  trace_buffer *add() {
+    std::lock_guard<std::mutex> lk(m_);
+    buffers_.push_back(std::unique_ptr<trace_buffer>(
+      new trace_buffer((int)buffers_.size(), scheduler::worker_index)));
+    return buffers_.back().get();
+  }
+
+  std::chrono::steady_clock::time_point start_;
+  std::mutex m_;
+  std::vector<std::unique_ptr<trace_buffer> > buffers_;
+};
+
+inline void trace_flow(char phase, uint64_t id)
+{
+  trace_event e = { "revision", phase, trace_registry::instance().now(), 0, id, nullptr, 0 };
+  trace_registry::local().push(e);
+}
+
+// records a complete event from its construction to its destruction
+class trace_scope {
+public:
+  trace_scope(const char *name, const char *arg_name = nullptr, uint64_t arg = 0)
+    : name_(name)
+    , arg_name_(arg_name)
+    , arg_(arg)
+    , start_(trace_registry::instance().now()) {}
+
+  ~trace_scope() {
+    uint64_t end = trace_registry::instance().now();
+    trace_event e = { name_, 'X', start_, end - start_, 0, arg_name_, arg_ };
+    trace_registry::local().push(e);
+  }
+
+private:
+  const char *name_;
+  const char *arg_name_;
+  uint64_t arg_;
+  uint64_t start_;
+};
+
+#else
+
+inline void trace_flow(char, uint64_t)
+{
+}
+
+class trace_scope {
+public:
+  trace_scope(const char *, const char * = nullptr, uint64_t = 0) {}
+};
+
+#endif
+
+// Flow ids linking the events of a revision: from fork to the start of
+// the revision, and from the end of its action to its join.
+inline uint64_t trace_fork_flow(uint64_t revision)
+{
+  return revision * 2;
+}
+
+inline uint64_t trace_join_flow(uint64_t revision)
+{
+  return revision * 2 + 1;
+}
+
+// nanoseconds as microseconds with three decimals
+inline void write_micros(std::ostream &os, uint64_t ns)
+{
+  os << ns / 1000 << '.' << (char)('0' + ns / 100 % 10)
+     << (char)('0' + ns / 10 % 10) << (char)('0' + ns % 10);
+}
+
+} // namespace detail
+
+// Writes the recorded fork, revision, join, abort, merge, collapse and
+// compact events in the Chrome trace event format, which chrome://tracing
+// and the Perfetto UI load. Fork and join are drawn as flow arrows between the
+// revisions. Events are only recorded when CONCURRENT_REVISIONS_TRACE is
+// defined; call this when no revision is running.
+inline void write_trace(std::ostream &os)
+{
+  os << "{\"traceEvents\":[";
+#ifdef CONCURRENT_REVISIONS_TRACE
+  bool first = true;
+  detail::trace_registry::instance().for_each_buffer([&](const detail::trace_buffer &b) {
+      os << (first ? "\n" : ",\n");
+      first = false;
+      os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b.tid_
+         << ",\"args\":{\"name\":\"";
+      if (b.worker_ >= 0)
+        os << "worker " << b.worker_;
+      else
+        os << "thread " << b.tid_;
+      os << "\"}}";
+      b.for_each([&](const detail::trace_event &e) {
+          os << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"" << e.phase
+             << "\",\"pid\":1,\"tid\":" << b.tid_
+             << ",\"ts\":";
+          detail::write_micros(os, e.ts);
+          if (e.phase == 'X') {
+            os << ",\"dur\":";
+            detail::write_micros(os, e.dur);
+          } else {
+            os << ",\"cat\":\"flow\",\"id\":" << e.id;
+          }
+          if (e.phase == 'f')
+            os << ",\"bp\":\"e\"";
+          if (e.arg_name)
+            os << ",\"args\":{\"" << e.arg_name << "\":" << e.arg << "}";
+          os << "}";
+        });
+    });
+#endif
+  os << "\n]}\n";
+}
+
+inline bool write_trace(const char *path)
+{
+  std::ofstream os(path);
+  write_trace(os);
+  return (bool)os;
+}
+
+// drops the recorded events; call this when no revision is running
+inline void clear_trace()
+{
+#ifdef CONCURRENT_REVISIONS_TRACE
+  detail::trace_registry::instance().for_each_buffer([](detail::trace_buffer &b) {
+      b.clear();
+    });
+#endif
+}
+
+} // namespace concurrent_revisions
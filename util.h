@@ -1,154 +1,692 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iterator>
+#include <numeric>
+#include <vector>
 #include "concurrent_revisions.h"
 
 namespace concurrent_revisions {
 
+// min_parallel of the algorithms below that has them choose their grain
+// size at run time
+static const std::size_t auto_grain = 0;
+
+namespace detail_ {
+template <typename = void>
+class partitioner_ {
+public:
+  static std::atomic<double> fork_cost_;
+  static std::atomic<bool> measuring_;
+};
+
+template <typename T>
+std::atomic<double> partitioner_<T>::fork_cost_(0);
+
+template <typename T>
+std::atomic<bool> partitioner_<T>::measuring_(false);
+} // namespace detail_
+
+namespace detail {
+
+// Decides how far the algorithms below split their ranges.
+//
+// With a fixed min_parallel, ranges are split down to min_parallel
+// elements. With auto_grain, leaves are timed and the grain is set so that
+// a leaf takes leaf_forks times as long as a fork and join. Ranges larger
+// than a few per thread are always split; smaller ones only while a worker
+// is idle or few tasks are queued, so that cheap leaves do not pay for
+// forks nobody steals.
+class partitioner : public detail_::partitioner_<> {
+public:
+  partitioner(std::size_t len, std::size_t min_parallel)
+    : fixed_(min_parallel)
+    , grain_(probe) {
+    std::size_t threads = scheduler::instance().size();
+    coarse_ = threads > 1 ? len / (4 * threads) : len;
+    // usually measured here, before the algorithm forks anything
+    if (min_parallel == auto_grain) fork_cost();
+  }
+
+  bool split(std::size_t len) const {
+    if (fixed_ != auto_grain) return len > fixed_;
+    if (len <= grain_.load(std::memory_order_relaxed)) return false;
+    if (len > coarse_) return true;
+    scheduler &sched = scheduler::instance();
+    return sched.idle() > 0 || sched.queued() < sched.size();
+  }
+
+  // runs the leaf f over len elements
+  template <class F>
+  void leaf(std::size_t len, F f) {
+    if (fixed_ != auto_grain || len == 0) {
+      f();
+      return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    f();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double cost = fork_cost();
+    if (cost == 0) return;
+    double grain = leaf_forks * cost * len / std::max(ns, 1.0);
+    grain_.store(grain < 1 ? 1 : grain > max_grain ? max_grain : std::size_t(grain),
+                 std::memory_order_relaxed);
+  }
+
+  // nanoseconds for a fork and join of an empty revision, measured once by
+  // the first caller; 0 to the others until then, which do not wait for it
+  // since it may be measured by a leaf they are joining
+  static double fork_cost() {
+    double cost = fork_cost_.load(std::memory_order_acquire);
+    if (cost == 0 && !measuring_.exchange(true)) {
+      cost = std::max(measure_fork_cost(), 1.0);
+      fork_cost_.store(cost, std::memory_order_release);
+    }
+    return cost;
+  }
+
+private:
+  // the fastest of a few rounds, since a round where a sleeping worker
+  // takes the revision also measures its wake-up
+  static double measure_fork_cost() {
+    const int rounds = 8, n = 16;
+    double best = 0;
+    for (int k = 0; k < rounds; ++k) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int i = 0; i < n; ++i) {
+        revision r = fork([] {});
+        join(r);
+      }
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
+      if (k == 0 || ns < best) best = ns;
+    }
+    return best;
+  }
+
+  // leaves until the first one has been timed
+  static const std::size_t probe = 16;
+  static const int leaf_forks = 16;
+  static const std::size_t max_grain = std::size_t(1) << 40;
+
+  std::size_t fixed_;
+  // ranges above this are always split
+  std::size_t coarse_;
+  std::atomic<std::size_t> grain_;
+};
+
+// Merges and partitions that span the whole range are split into about
+// four parts per thread; the recursion of the sort has enough parallelism
+// below that, and finer splits only add forks. With auto_grain, parts have
+// at least 1024 elements.
+inline std::size_t split_grain(std::size_t len, std::size_t min_parallel)
+{
+  if (min_parallel == auto_grain) min_parallel = 1024;
+  std::size_t threads = scheduler::instance().size();
+  return threads > 1 ? std::max(min_parallel, len / (4 * threads)) : len;
+}
+
+} // namespace detail
+
 template <class Iterator, class F>
-void parallel_foreach(Iterator begin, Iterator end, F f, size_t min_parallel = 1024)
+void parallel_foreach_impl(Iterator begin, Iterator end, F &f, detail::partitioner &part)
 {
   size_t len = end - begin;
 
-  if (len <= min_parallel) {
-    std::for_each(begin, end, f);
+  if (!part.split(len)) {
+    part.leaf(len, [&] { std::for_each(begin, end, f); });
   }
   else {
     revision r = fork([&]{
-        parallel_foreach(begin, begin + len / 2, f, min_parallel);
+        parallel_foreach_impl(begin, begin + len / 2, f, part);
       });
-    parallel_foreach(begin + len / 2, end, f, min_parallel);
+    parallel_foreach_impl(begin + len / 2, end, f, part);
     join(r);
   }
 }
 
+template <class Iterator, class F>
+void parallel_foreach(Iterator begin, Iterator end, F f, size_t min_parallel = auto_grain)
+{
+  detail::partitioner part(end - begin, min_parallel);
+  parallel_foreach_impl(begin, end, f, part);
+}
+
 template <class InputIterator, class OutputRandomAccessIterator, class F>
-void parallel_transform(InputIterator begin, InputIterator end, OutputRandomAccessIterator out, F f, size_t min_parallel = 1024)
+void parallel_transform_impl(InputIterator begin, InputIterator end, OutputRandomAccessIterator out, F &f, detail::partitioner &part)
 {
   size_t const len = end - begin;
 
-  if (len <= min_parallel) {
-    std::transform(begin, end, out, f);
+  if (!part.split(len)) {
+    part.leaf(len, [&] { std::transform(begin, end, out, f); });
   }
   else {
-    revision r = fork([&begin, &out, &len, &f, &min_parallel]{
-        parallel_transform(begin, begin + len / 2, out, f, min_parallel);
+    revision r = fork([&begin, &out, &len, &f, &part]{
+        parallel_transform_impl(begin, begin + len / 2, out, f, part);
       });
-    parallel_transform(begin + len / 2, end, out + len / 2, f, min_parallel);
+    parallel_transform_impl(begin + len / 2, end, out + len / 2, f, part);
     join(r);
   }
 }
 
+template <class InputIterator, class OutputRandomAccessIterator, class F>
+void parallel_transform(InputIterator begin, InputIterator end, OutputRandomAccessIterator out, F f, size_t min_parallel = auto_grain)
+{
+  detail::partitioner part(end - begin, min_parallel);
+  parallel_transform_impl(begin, end, out, f, part);
+}
+
 template <class InputIterator1, class InputIterator2, class OutputRandomAccessIterator, class F>
-void parallel_transform(InputIterator1 begin1, InputIterator1 end1, InputIterator2 begin2, InputIterator2 end2, OutputRandomAccessIterator out, F f, size_t min_parallel = 1024)
+void parallel_transform_impl(InputIterator1 begin1, InputIterator1 end1, InputIterator2 begin2, InputIterator2 end2, OutputRandomAccessIterator out, F &f, detail::partitioner &part)
 {
   size_t const len1 = end1 - begin1;
   size_t const len2 = end2 - begin2;
   size_t const len = std::min(len1, len2);
 
-  if (len <= min_parallel) {
-    std::transform(begin1, begin1+len, begin2, out, f);
+  if (!part.split(len)) {
+    part.leaf(len, [&] { std::transform(begin1, begin1+len, begin2, out, f); });
   }
   else {
-    revision r = fork([&len, &begin1, &begin2, &out, &f, &min_parallel]{
-        parallel_transform(begin1, begin1 + len / 2, begin2, begin2 + len / 2, out, f, min_parallel);
+    revision r = fork([&len, &begin1, &begin2, &out, &f, &part]{
+        parallel_transform_impl(begin1, begin1 + len / 2, begin2, begin2 + len / 2, out, f, part);
       });
 
-    parallel_transform(begin1 + len / 2, begin1 + len, begin2 + len / 2, begin2 + len, out + len / 2, f, min_parallel);
+    parallel_transform_impl(begin1 + len / 2, begin1 + len, begin2 + len / 2, begin2 + len, out + len / 2, f, part);
     join(r);
   }
 }
 
+template <class InputIterator1, class InputIterator2, class OutputRandomAccessIterator, class F>
+void parallel_transform(InputIterator1 begin1, InputIterator1 end1, InputIterator2 begin2, InputIterator2 end2, OutputRandomAccessIterator out, F f, size_t min_parallel = auto_grain)
+{
+  detail::partitioner part(std::min(end1 - begin1, end2 - begin2), min_parallel);
+  parallel_transform_impl(begin1, end1, begin2, end2, out, f, part);
+}
+
 template <class Iterator>
-void parallel_max_element_impl(Iterator first, Iterator last, versioned<Iterator, max_iter_merger<Iterator> >& v, std::size_t min_parallel)
+void parallel_max_element_impl(Iterator first, Iterator last, versioned<Iterator, max_iter_merger<Iterator> >& v, detail::partitioner &part)
 {
   std::size_t len = std::distance(first, last);
 
-  if (len <= min_parallel) {
-    v = std::max_element(first, last);
+  if (!part.split(len)) {
+    part.leaf(len, [&] { v = std::max_element(first, last); });
   } else {
     revision r = fork([&] {
-        parallel_max_element_impl(first, first + len/2, v, min_parallel);
+        parallel_max_element_impl(first, first + len/2, v, part);
       });
-    parallel_max_element_impl(first + len/2, last, v, min_parallel);
+    parallel_max_element_impl(first + len/2, last, v, part);
     join(r);
   }
 }
 
 template <class Iterator>
-Iterator parallel_max_element(Iterator first, Iterator last, std::size_t min_parallel = 1024)
+Iterator parallel_max_element(Iterator first, Iterator last, std::size_t min_parallel = auto_grain)
 {
   versioned<Iterator, max_iter_merger<Iterator> > v;
-  parallel_max_element_impl(first, last, v, min_parallel);
+  detail::partitioner part(std::distance(first, last), min_parallel);
+  parallel_max_element_impl(first, last, v, part);
   return v;
 }
 
 template <class Iterator>
-void parallel_min_element_impl(Iterator first, Iterator last, versioned<Iterator, min_iter_merger<Iterator> >& v, std::size_t min_parallel)
+void parallel_min_element_impl(Iterator first, Iterator last, versioned<Iterator, min_iter_merger<Iterator> >& v, detail::partitioner &part)
 {
   std::size_t len = std::distance(first, last);
 
-  if (len <= min_parallel) {
-    v = std::min_element(first, last);
+  if (!part.split(len)) {
+    part.leaf(len, [&] { v = std::min_element(first, last); });
   } else {
     revision r = fork([&] {
-        parallel_min_element_impl(first, first + len/2, v, min_parallel);
+        parallel_min_element_impl(first, first + len/2, v, part);
       });
-    parallel_min_element_impl(first + len/2, last, v, min_parallel);
+    parallel_min_element_impl(first + len/2, last, v, part);
     join(r);
   }
 }
 
 template <class Iterator>
-Iterator parallel_min_element(Iterator first, Iterator last, std::size_t min_parallel = 1024)
+Iterator parallel_min_element(Iterator first, Iterator last, std::size_t min_parallel = auto_grain)
 {
   versioned<Iterator, min_iter_merger<Iterator> > v;
-  parallel_min_element_impl(first, last, v, min_parallel);
+  detail::partitioner part(std::distance(first, last), min_parallel);
+  parallel_min_element_impl(first, last, v, part);
   return v;
 }
 
-template <class Iterator, class Less>
-void parallel_stable_sort(Iterator first, Iterator last, Less f, std::size_t min_parallel = 1024)
+template <class Iterator1, class Iterator2>
+void parallel_swap_ranges_impl(Iterator1 first1, Iterator1 last1, Iterator2 first2, detail::partitioner &part)
 {
-  std::size_t len = std::distance(first, last);
+  std::size_t len = std::distance(first1, last1);
 
-  if (len <= min_parallel) {
-    std::stable_sort(first, last, f);
+  if (!part.split(len)) {
+    part.leaf(len, [&] { std::swap_ranges(first1, last1, first2); });
   } else {
-    Iterator mid = first + len/2;
+    auto mid1 = first1 + len/2;
+    auto mid2 = first2 + len/2;
+
     revision r = fork([&] {
-        parallel_stable_sort(first, mid, f, min_parallel);
+        parallel_swap_ranges_impl(first1, mid1, first2, part);
       });
-    parallel_stable_sort(mid, last, f, min_parallel);
+    parallel_swap_ranges_impl(mid1, last1, mid2, part);
     join(r);
-    std::inplace_merge(first, mid, last, f);
+  }
+}
+
+template <class Iterator1, class Iterator2>
+void parallel_swap_ranges(Iterator1 first1, Iterator1 last1, Iterator2 first2, std::size_t min_parallel = auto_grain)
+{
+  detail::partitioner part(std::distance(first1, last1), min_parallel);
+  parallel_swap_ranges_impl(first1, last1, first2, part);
+}
+
+namespace detail {
+
+// Merges [first1, last1) and [first2, last2) into out, moving the elements.
+// The longer range is split at its middle and the other one at the
+// matching position by binary search, so both halves merge in parallel;
+// equal elements of the first range still come first.
+template <class Iterator1, class Iterator2, class OutputIterator, class Less>
+void parallel_merge(Iterator1 first1, Iterator1 last1, Iterator2 first2, Iterator2 last2, OutputIterator out, Less f, std::size_t min_parallel)
+{
+  std::size_t len1 = std::distance(first1, last1);
+  std::size_t len2 = std::distance(first2, last2);
+
+  // with one element or none on each side, a split can leave all of them
+  // in one half
+  if (len1 + len2 <= min_parallel || (len1 <= 1 && len2 <= 1)) {
+    std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+               std::make_move_iterator(first2), std::make_move_iterator(last2), out, f);
+    return;
+  }
+
+  Iterator1 mid1;
+  Iterator2 mid2;
+  if (len1 >= len2) {
+    mid1 = first1 + len1/2;
+    mid2 = std::lower_bound(first2, last2, *mid1, f);
+  } else {
+    mid2 = first2 + len2/2;
+    mid1 = std::upper_bound(first1, last1, *mid2, f);
+  }
+  OutputIterator mid = out + (mid1 - first1) + (mid2 - first2);
+  revision r = fork([&] {
+      parallel_merge(first1, mid1, first2, mid2, out, f, min_parallel);
+    });
+  parallel_merge(mid1, last1, mid2, last2, mid, f, min_parallel);
+  join(r);
+}
+
+// Sorts [first, last), leaving the result in buf if to_buf is set. The
+// halves are sorted into the other of the range and buf and merged back,
+// so the levels of the recursion take turns writing to buf. Merges are
+// split into parts of at least merge_grain elements.
+template <class Iterator, class Buffer, class Less>
+void parallel_stable_sort(Iterator first, Iterator last, Buffer buf, bool to_buf, Less f, partitioner &part, std::size_t merge_grain)
+{
+  std::size_t len = std::distance(first, last);
+
+  if (!part.split(len)) {
+    part.leaf(len, [&] {
+        std::stable_sort(first, last, f);
+        if (to_buf) std::move(first, last, buf);
+      });
+    return;
+  }
+
+  Iterator mid = first + len/2;
+  revision r = fork([&] {
+      parallel_stable_sort(first, mid, buf, !to_buf, f, part, merge_grain);
+    });
+  parallel_stable_sort(mid, last, buf + len/2, !to_buf, f, part, merge_grain);
+  join(r);
+  if (to_buf)
+    parallel_merge(first, mid, mid, last, buf, f, merge_grain);
+  else
+    parallel_merge(buf, buf + len/2, buf + len/2, buf + len, first, f, merge_grain);
+}
+
+// Partitions [first, last) by pred like std::partition. The halves are
+// partitioned in parallel, and the elements of the first half failing
+// pred are then swapped with those of the second half satisfying it.
+template <class Iterator, class Pred>
+Iterator parallel_partition(Iterator first, Iterator last, Pred pred, std::size_t grain)
+{
+  std::size_t len = std::distance(first, last);
+
+  if (len <= grain)
+    return std::partition(first, last, pred);
+
+  Iterator mid = first + len/2;
+  Iterator a, b;
+  revision r = fork([&] {
+      a = parallel_partition(first, mid, pred, grain);
+    });
+  b = parallel_partition(mid, last, pred, grain);
+  join(r);
+
+  // [a, mid) fails pred and [mid, b) satisfies it
+  std::size_t k = std::min(mid - a, b - mid);
+  concurrent_revisions::parallel_swap_ranges(a, a + k, b - k, grain);
+  return a + (b - mid);
+}
+
+} // namespace detail
+
+// Stable sort by parallel merge sort. Needs a buffer of std::distance(first,
+// last) elements, allocated once and copied from the input.
+template <class Iterator, class Less>
+void parallel_stable_sort(Iterator first, Iterator last, Less f, std::size_t min_parallel = auto_grain)
+{
+  std::size_t len = std::distance(first, last);
+  detail::partitioner part(len, min_parallel);
+
+  if (!part.split(len)) {
+    std::stable_sort(first, last, f);
+  } else {
+    std::vector<typename std::iterator_traits<Iterator>::value_type> buf(first, last);
+    detail::parallel_stable_sort(first, last, buf.begin(), false, f, part, detail::split_grain(len, min_parallel));
   }
 }
 
 template <class Iterator>
-void parallel_stable_sort(Iterator first, Iterator last, std::size_t min_parallel = 1024)
+void parallel_stable_sort(Iterator first, Iterator last, std::size_t min_parallel = auto_grain)
 {
   parallel_stable_sort(first, last, std::less<typename std::iterator_traits<Iterator>::value_type>(), min_parallel);
 }
 
-template <class Iterator1, class Iterator2>
-void parallel_swap_ranges(Iterator1 first1, Iterator1 last1, Iterator2 first2, std::size_t min_parallel = 1024)
+namespace detail {
+
+template <class T, class Less>
+const T &median3(const T &a, const T &b, const T &c, Less &f)
 {
-  std::size_t len = std::distance(first1, last1);
+  return f(a, b) ? (f(b, c) ? b : f(a, c) ? c : a)
+                 : (f(a, c) ? a : f(b, c) ? c : b);
+}
 
-  if (len <= min_parallel) {
-    std::swap_ranges(first1, last1, first2);
-  } else {
-    auto mid1 = first1 + len/2;
-    auto mid2 = first2 + len/2;
+// depth is the number of splits left before a range is sorted
+// sequentially, as in introsort, since the pivot can be bad at every level
+template <class Iterator, class Less>
+void parallel_sort(Iterator first, Iterator last, Less f, partitioner &part, std::size_t grain, int depth)
+{
+  typedef typename std::iterator_traits<Iterator>::value_type value_type;
+  std::size_t len = std::distance(first, last);
 
-    revision r = fork([&] {
-        parallel_swap_ranges(first1, mid1, first2, min_parallel);
+  if (depth == 0 || !part.split(len)) {
+    part.leaf(len, [&] { std::sort(first, last, f); });
+    return;
+  }
+
+  // median of the medians of three groups of three
+  Iterator mid = first + len/2;
+  std::size_t d = len / 8;
+  value_type pivot = median3(median3(*first, *(first + d), *(first + 2*d), f),
+                             median3(*(mid - d), *mid, *(mid + d), f),
+                             median3(*(last - 1 - 2*d), *(last - 1 - d), *(last - 1), f), f);
+
+  Iterator lo = parallel_partition(first, last, [&](const value_type &x) { return f(x, pivot); }, grain);
+  Iterator hi = parallel_partition(lo, last, [&](const value_type &x) { return !f(pivot, x); }, grain);
+
+  revision r = fork([&] {
+      parallel_sort(first, lo, f, part, grain, depth - 1);
+    });
+  parallel_sort(hi, last, f, part, grain, depth - 1);
+  join(r);
+}
+
+} // namespace detail
+
+// Unstable in-place sort by parallel quicksort. Each range is split three
+// ways around a median of nine of its elements, so equal keys do not
+// degrade it. Ranges still unsorted after 2 log2(n) splits are
+// sorted by std::sort.
+template <class Iterator, class Less>
+void parallel_sort(Iterator first, Iterator last, Less f, std::size_t min_parallel = auto_grain)
+{
+  std::size_t len = std::distance(first, last);
+  int depth = 0;
+  for (std::size_t n = len; n > 1; n /= 2)
+    depth += 2;
+  detail::partitioner part(len, min_parallel);
+  detail::parallel_sort(first, last, f, part, detail::split_grain(len, min_parallel), depth);
+}
+
+template <class Iterator>
+void parallel_sort(Iterator first, Iterator last, std::size_t min_parallel = auto_grain)
+{
+  parallel_sort(first, last, std::less<typename std::iterator_traits<Iterator>::value_type>(), min_parallel);
+}
+
+namespace detail {
+
+// reduces a nonempty range
+template <class Iterator, class T, class Op>
+T reduce(Iterator first, Iterator last, Op &op)
+{
+  T acc = *first;
+  for (++first; first != last; ++first)
+    acc = op(acc, *first);
+  return acc;
+}
+
+template <class Iterator, class T, class Op>
+T parallel_reduce(Iterator first, Iterator last, Op &op, partitioner &part)
+{
+  std::size_t len = std::distance(first, last);
+
+  // partial results start from the first element of their subrange
+  if (!part.split(len)) {
+    T acc = *first;
+    part.leaf(len, [&] { acc = reduce<Iterator, T>(first, last, op); });
+    return acc;
+  }
+
+  Iterator mid = first + len/2;
+  T left = *first;
+  revision r = fork([&] {
+      left = parallel_reduce<Iterator, T>(first, mid, op, part);
+    });
+  T right = parallel_reduce<Iterator, T>(mid, last, op, part);
+  join(r);
+  return op(left, right);
+}
+
+// Two-pass blocked scan: the blocks are reduced in parallel, the block sums
+// are scanned on this thread, and the blocks are then scanned in parallel
+// starting from their offsets. out may be first.
+template <class Iterator, class OutputIterator, class T, class Op>
+OutputIterator parallel_scan(Iterator first, Iterator last, OutputIterator out, const T *init, Op op, std::size_t min_parallel)
+{
+  std::size_t len = std::distance(first, last);
+  std::size_t block = split_grain(len, min_parallel);
+  std::size_t blocks = len ? (len + block - 1) / block : 0;
+
+  // offsets[b] is the sum of everything before block b, if anything
+  std::vector<T> offsets(blocks);
+  if (blocks > 1) {
+    std::vector<T> sums(blocks - 1);
+    std::vector<std::size_t> ix(blocks - 1);
+    for (std::size_t b = 0; b < ix.size(); ++b) ix[b] = b;
+    concurrent_revisions::parallel_foreach(ix.begin(), ix.end(), [&](std::size_t b) {
+        sums[b] = reduce<Iterator, T>(first + b * block, first + (b + 1) * block, op);
+      }, 1);
+    for (std::size_t b = 1; b < blocks; ++b)
+      offsets[b] = b == 1 ? (init ? op(*init, sums[0]) : sums[0]) : op(offsets[b - 1], sums[b - 1]);
+  }
+  if (init && blocks) offsets[0] = *init;
+
+  std::vector<std::size_t> ix(blocks);
+  for (std::size_t b = 0; b < blocks; ++b) ix[b] = b;
+  concurrent_revisions::parallel_foreach(ix.begin(), ix.end(), [&](std::size_t b) {
+      Iterator p = first + b * block;
+      Iterator q = b + 1 < blocks ? p + block : last;
+      OutputIterator o = out + b * block;
+      if (init) {
+        // exclusive: read each element before its output overwrites it
+        T acc = offsets[b];
+        for (; p != q; ++p, ++o) {
+          T x = *p;
+          *o = acc;
+          acc = op(acc, x);
+        }
+      } else {
+        T acc = b == 0 ? T(*p++) : op(offsets[b], *p++);
+        *o++ = acc;
+        for (; p != q; ++p, ++o) {
+          acc = op(acc, *p);
+          *o = acc;
+        }
+      }
+    }, 1);
+  return out + len;
+}
+
+} // namespace detail
+
+// Reduces [first, last) with op, which must be associative; the result is
+// op(init, reduction of the range). Each leaf is reduced by a sequential
+// loop, and only the leaves' results are combined across revisions. With
+// a fixed min_parallel, leaves have at least min_parallel elements, a few
+// per thread.
+template <class Iterator, class T, class Op>
+T parallel_reduce(Iterator first, Iterator last, T init, Op op, std::size_t min_parallel = auto_grain)
+{
+  if (first == last) return init;
+  std::size_t len = std::distance(first, last);
+  detail::partitioner part(len, min_parallel == auto_grain ? auto_grain : detail::split_grain(len, min_parallel));
+  return op(init, detail::parallel_reduce<Iterator, T>(first, last, op, part));
+}
+
+template <class Iterator, class T>
+T parallel_reduce(Iterator first, Iterator last, T init, std::size_t min_parallel = auto_grain)
+{
+  return parallel_reduce(first, last, init, std::plus<T>(), min_parallel);
+}
+
+// Writes op(x[0], ..., x[i]) to out[i] for every i, like std::partial_sum;
+// op must be associative. out may be first. Returns the end of the output.
+template <class Iterator, class OutputIterator, class Op>
+OutputIterator parallel_inclusive_scan(Iterator first, Iterator last, OutputIterator out, Op op, std::size_t min_parallel = auto_grain)
+{
+  typedef typename std::iterator_traits<Iterator>::value_type value_type;
+  return detail::parallel_scan(first, last, out, static_cast<const value_type*>(nullptr), op, min_parallel);
+}
+
+template <class Iterator, class OutputIterator>
+OutputIterator parallel_inclusive_scan(Iterator first, Iterator last, OutputIterator out, std::size_t min_parallel = auto_grain)
+{
+  return parallel_inclusive_scan(first, last, out, std::plus<typename std::iterator_traits<Iterator>::value_type>(), min_parallel);
+}
+
+// Writes op(init, x[0], ..., x[i - 1]) to out[i] for every i; op must be
+// associative. out may be first. Returns the end of the output.
+template <class Iterator, class OutputIterator, class T, class Op>
+OutputIterator parallel_exclusive_scan(Iterator first, Iterator last, OutputIterator out, T init, Op op, std::size_t min_parallel = auto_grain)
+{
+  return detail::parallel_scan(first, last, out, &init, op, min_parallel);
+}
+
+template <class Iterator, class OutputIterator, class T>
+OutputIterator parallel_exclusive_scan(Iterator first, Iterator last, OutputIterator out, T init, std::size_t min_parallel = auto_grain)
+{
+  return parallel_exclusive_scan(first, last, out, init, std::plus<T>(), min_parallel);
+}
+
+namespace detail {
+
+// Cancellation token of a search: the index of the leftmost match found
+// so far. Revisions poll it and give up on elements past a match.
+class leftmost_match {
+public:
+  explicit leftmost_match(std::size_t none)
+    : index_(none) {}
+
+  std::size_t index() const {
+    return index_.load(std::memory_order_relaxed);
+  }
+
+  // whether a match before i has been found
+  bool before(std::size_t i) const {
+    return index() < i;
+  }
+
+  void found(std::size_t i) {
+    std::size_t cur = index();
+    while (i < cur && !index_.compare_exchange_weak(cur, i, std::memory_order_relaxed)) {}
+  }
+
+private:
+  std::atomic<std::size_t> index_;
+};
+
+// Searches [first + begin, first + end). The left half runs here and the
+// right half is forked, so that without idle workers the range is
+// searched in order and matches near the front end the search early.
+template <class Iterator, class Pred>
+void parallel_find_if(Iterator first, std::size_t begin, std::size_t end, Pred &pred, leftmost_match &m, partitioner &part)
+{
+  // elements between polls of m
+  const std::size_t poll = 1024;
+
+  if (m.before(begin)) return;
+  std::size_t len = end - begin;
+
+  if (!part.split(len)) {
+    part.leaf(len, [&] {
+        for (std::size_t i = begin; i < end; i += poll) {
+          if (m.before(i)) return;
+          Iterator p = first + i, q = first + std::min(end, i + poll);
+          Iterator it = std::find_if(p, q, pred);
+          if (it != q) {
+            m.found(it - first);
+            return;
+          }
+        }
       });
-    parallel_swap_ranges(mid1, last1, mid2, min_parallel);
-    join(r);
+    return;
   }
+
+  std::size_t mid = begin + len/2;
+  revision r = fork([&] {
+      parallel_find_if(first, mid, end, pred, m, part);
+    });
+  parallel_find_if(first, begin, mid, pred, m, part);
+  join(r);
+}
+
+} // namespace detail
+
+// Returns the first iterator in [first, last) satisfying pred, or last.
+// Revisions stop once a match before their elements has been found, and
+// the result is the leftmost match regardless of scheduling.
+template <class Iterator, class Pred>
+Iterator parallel_find_if(Iterator first, Iterator last, Pred pred, std::size_t min_parallel = auto_grain)
+{
+  std::size_t len = std::distance(first, last);
+  detail::leftmost_match m(len);
+  detail::partitioner part(len, min_parallel);
+  detail::parallel_find_if(first, 0, len, pred, m, part);
+  return first + m.index();
+}
+
+template <class Iterator, class Pred>
+bool parallel_any_of(Iterator first, Iterator last, Pred pred, std::size_t min_parallel = auto_grain)
+{
+  return parallel_find_if(first, last, pred, min_parallel) != last;
+}
+
+template <class Iterator, class Pred>
+bool parallel_none_of(Iterator first, Iterator last, Pred pred, std::size_t min_parallel = auto_grain)
+{
+  return !parallel_any_of(first, last, pred, min_parallel);
+}
+
+template <class Iterator, class Pred>
+bool parallel_all_of(Iterator first, Iterator last, Pred pred, std::size_t min_parallel = auto_grain)
+{
+  typedef typename std::iterator_traits<Iterator>::reference reference;
+  return !parallel_any_of(first, last, [&](reference x) { return !pred(x); }, min_parallel);
 }
 
 } // namespace concurrent_revisions
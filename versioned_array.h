@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "concurrent_revisions.h"
+
+namespace concurrent_revisions {
+
+namespace detail {
+
+// A chunk of a versioned_array. Each element carries the version of the
+// segment that wrote it, so a join can tell which elements the joined
+// revision changed. An empty chunk has never been written: its elements
+// are T() and its stamps are -1.
+template <class T>
+class array_chunk {
+public:
+  bool empty() const {
+    return data_.empty();
+  }
+
+  void fill(size_t n) {
+    data_.assign(n, T());
+    stamps_.assign(n, -1);
+  }
+
+  std::vector<T> data_;
+  std::vector<version_t> stamps_;
+};
+
+// merges chunks element by element; only elements the joined revision
+// wrote go through Merge, the others keep the joiner's value
+template <class T, class Merge, size_t ChunkSize>
+class chunk_merger {
+public:
+  array_chunk<T> operator()(const array_chunk<T> &main, const array_chunk<T> &join, const array_chunk<T> &root) const {
+    if (join.empty()) return main;
+    array_chunk<T> r = main;
+    if (r.empty()) r.fill(ChunkSize);
+    for (size_t i = 0; i < ChunkSize; ++i) {
+      version_t root_stamp = root.empty() ? -1 : root.stamps_[i];
+      if (join.stamps_[i] == root_stamp) continue;
+      r.data_[i] = mf_(r.data_[i], join.data_[i], root.empty() ? zero() : root.data_[i]);
+      r.stamps_[i] = join.stamps_[i];
+    }
+    return r;
+  }
+
+  static const T &zero() {
+    static const T z = T();
+    return z;
+  }
+
+private:
+  Merge mf_;
+};
+
+} // namespace detail
+
+// Fixed-size array whose elements are versioned in chunks of ChunkSize.
+//
+// The first write to a chunk in a segment copies only that chunk, and a
+// join merges each chunk the joined revision wrote element by element
+// with Merge, which is applied only to the elements the revision wrote.
+// Elements cost an extra 8 bytes for the write stamp.
+template <class T, class Merge = default_merger<T>, size_t ChunkSize = 1024>
+class versioned_array {
+  typedef detail::array_chunk<T> chunk;
+  typedef detail::chunk_merger<T, Merge, ChunkSize> merger;
+
+public:
+  explicit versioned_array(size_t n)
+    : size_(n)
+    , chunks_((n + ChunkSize - 1) / ChunkSize) {
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  const T &get(size_t i) const {
+    const chunk &c = chunks_[i / ChunkSize];
+    return c.empty() ? merger::zero() : c.data_[i % ChunkSize];
+  }
+
+  const T &operator[](size_t i) const {
+    return get(i);
+  }
+
+  void set(size_t i, const T &v) {
+    chunk &c = chunks_[i / ChunkSize].p_->local();
+    if (c.empty()) c.fill(ChunkSize);
+    c.data_[i % ChunkSize] = v;
+    c.stamps_[i % ChunkSize] = revision_impl::current_revision->current_->version_;
+  }
+
+private:
+  size_t size_;
+  std::vector<versioned<chunk, merger> > chunks_;
+};
+
+} // namespace concurrent_revisions
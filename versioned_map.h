@@ -0,0 +1,368 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "concurrent_revisions.h"
+
+namespace concurrent_revisions {
+
+namespace detail {
+
+// Persistent hash array mapped trie. Nodes are immutable and shared
+// between versions; an update copies the path from the root to the key.
+//
+// Every key lives in its own leaf, so two versions hold the same value for
+// a key exactly when they share its leaf, and subtrees two versions share
+// can be skipped when comparing them.
+template <class K, class V>
+class hamt {
+public:
+  struct node;
+  typedef std::shared_ptr<const node> node_ptr;
+
+  struct node {
+    enum kind_t { branch, leaf, collision };
+
+    kind_t kind;
+    // branch: bit i is set if there is a child for hash digit i
+    uint32_t bitmap;
+    // branch: children in digit order; collision: leaves with equal hashes
+    std::vector<node_ptr> children;
+    // leaf and collision
+    size_t hash;
+    // leaf
+    std::pair<K, V> entry;
+  };
+
+  static const int bits = 5;
+
+  hamt()
+    : size_(0) {}
+
+  size_t size() const {
+    return size_;
+  }
+
+  const V *find(const K &k, size_t h) const {
+    const node *l = find_leaf(root_.get(), k, h, 0);
+    return l ? &l->entry.second : nullptr;
+  }
+
+  void set(const K &k, const V &v, size_t h) {
+    bool added = false;
+    root_ = insert(root_, make_leaf(k, v, h), 0, added);
+    if (added) ++size_;
+  }
+
+  void erase(const K &k, size_t h) {
+    bool removed = false;
+    root_ = remove(root_, k, h, 0, removed);
+    if (removed) --size_;
+  }
+
+  // calls f(key, value) for every entry
+  template <class F>
+  void for_each(F f) const {
+    for_each(root_.get(), f);
+  }
+
+  // calls f(key, hash, value in this or nullptr, value in base or nullptr)
+  // for every key whose value differs from base
+  template <class F>
+  void diff(const hamt &base, F f) const {
+    diff(root_, base.root_, 0, f);
+  }
+
+private:
+  static size_t digit(size_t h, int shift) {
+    return (h >> shift) & ((1 << bits) - 1);
+  }
+
+  static size_t index(uint32_t bitmap, size_t d) {
+    return __builtin_popcount(bitmap & ((uint32_t(1) << d) - 1));
+  }
+
+  static node_ptr make_leaf(const K &k, const V &v, size_t h) {
+    std::shared_ptr<node> n = std::make_shared<node>();
+    n->kind = node::leaf;
+    n->bitmap = 0;
+    n->hash = h;
+    n->entry = std::make_pair(k, v);
+    return n;
+  }
+
+  static const node *find_leaf(const node *n, const K &k, size_t h, int shift) {
+    while (n) {
+      if (n->kind == node::leaf)
+        return n->hash == h && n->entry.first == k ? n : nullptr;
+      if (n->kind == node::collision) {
+        if (n->hash != h) return nullptr;
+        for (size_t i = 0; i < n->children.size(); ++i)
+          if (n->children[i]->entry.first == k) return n->children[i].get();
+        return nullptr;
+      }
+      size_t d = digit(h, shift);
+      if (!(n->bitmap & (uint32_t(1) << d))) return nullptr;
+      n = n->children[index(n->bitmap, d)].get();
+      shift += bits;
+    }
+    return nullptr;
+  }
+
+  // a branch at shift holding leaves or collision nodes a and b, whose
+  // hashes differ
+  static node_ptr join_nodes(const node_ptr &a, const node_ptr &b, int shift) {
+    std::shared_ptr<node> n = std::make_shared<node>();
+    n->kind = node::branch;
+    n->hash = 0;
+    size_t da = digit(a->hash, shift), db = digit(b->hash, shift);
+    if (da == db) {
+      n->bitmap = uint32_t(1) << da;
+      n->children.push_back(join_nodes(a, b, shift + bits));
+    } else {
+      n->bitmap = (uint32_t(1) << da) | (uint32_t(1) << db);
+      n->children.push_back(da < db ? a : b);
+      n->children.push_back(da < db ? b : a);
+    }
+    return n;
+  }
+
+  static node_ptr insert(const node_ptr &n, const node_ptr &l, int shift, bool &added) {
+    if (!n) {
+      added = true;
+      return l;
+    }
+    const K &k = l->entry.first;
+    if (n->kind != node::branch) {
+      if (n->hash != l->hash) {
+        added = true;
+        return join_nodes(n, l, shift);
+      }
+      if (n->kind == node::leaf && n->entry.first == k)
+        return l;
+      std::shared_ptr<node> c = std::make_shared<node>();
+      c->kind = node::collision;
+      c->bitmap = 0;
+      c->hash = l->hash;
+      if (n->kind == node::leaf)
+        c->children.push_back(n);
+      else
+        c->children = n->children;
+      for (size_t i = 0; i < c->children.size(); ++i) {
+        if (c->children[i]->entry.first == k) {
+          c->children[i] = l;
+          return c;
+        }
+      }
+      added = true;
+      c->children.push_back(l);
+      return c;
+    }
+
+    size_t d = digit(l->hash, shift);
+    uint32_t bit = uint32_t(1) << d;
+    size_t i = index(n->bitmap, d);
+    std::shared_ptr<node> c = std::make_shared<node>(*n);
+    if (n->bitmap & bit) {
+      c->children[i] = insert(n->children[i], l, shift + bits, added);
+    } else {
+      added = true;
+      c->bitmap |= bit;
+      c->children.insert(c->children.begin() + i, l);
+    }
+    return c;
+  }
+
+  static node_ptr remove(const node_ptr &n, const K &k, size_t h, int shift, bool &removed) {
+    if (!n) return n;
+    if (n->kind == node::leaf) {
+      if (n->hash != h || !(n->entry.first == k)) return n;
+      removed = true;
+      return node_ptr();
+    }
+    if (n->kind == node::collision) {
+      if (n->hash != h) return n;
+      for (size_t i = 0; i < n->children.size(); ++i) {
+        if (n->children[i]->entry.first == k) {
+          removed = true;
+          if (n->children.size() == 2)
+            return n->children[1 - i];
+          std::shared_ptr<node> c = std::make_shared<node>(*n);
+          c->children.erase(c->children.begin() + i);
+          return c;
+        }
+      }
+      return n;
+    }
+
+    size_t d = digit(h, shift);
+    uint32_t bit = uint32_t(1) << d;
+    if (!(n->bitmap & bit)) return n;
+    size_t i = index(n->bitmap, d);
+    node_ptr child = remove(n->children[i], k, h, shift + bits, removed);
+    if (child == n->children[i]) return n;
+    if (!child && n->children.size() == 1) return child;
+    // a branch left with a single leaf is replaced by the leaf
+    if (!child && n->children.size() == 2 && n->children[1 - i]->kind != node::branch)
+      return n->children[1 - i];
+    if (child && n->children.size() == 1 && child->kind != node::branch)
+      return child;
+    std::shared_ptr<node> c = std::make_shared<node>(*n);
+    if (child) {
+      c->children[i] = child;
+    } else {
+      c->bitmap &= ~bit;
+      c->children.erase(c->children.begin() + i);
+    }
+    return c;
+  }
+
+  template <class F>
+  static void for_each(const node *n, F &f) {
+    if (!n) return;
+    if (n->kind == node::leaf) {
+      f(n->entry.first, n->entry.second);
+      return;
+    }
+    for (size_t i = 0; i < n->children.size(); ++i)
+      for_each(n->children[i].get(), f);
+  }
+
+  template <class F>
+  static void for_each_leaf(const node *n, F &f) {
+    if (!n) return;
+    if (n->kind == node::leaf) {
+      f(n);
+      return;
+    }
+    for (size_t i = 0; i < n->children.size(); ++i)
+      for_each_leaf(n->children[i].get(), f);
+  }
+
+  template <class F>
+  static void diff(const node_ptr &a, const node_ptr &b, int shift, F &f) {
+    if (a == b) return;
+    if (a && b && a->kind == node::branch && b->kind == node::branch) {
+      uint32_t bitmap = a->bitmap | b->bitmap;
+      for (size_t d = 0; d < (size_t(1) << bits); ++d) {
+        uint32_t bit = uint32_t(1) << d;
+        if (!(bitmap & bit)) continue;
+        node_ptr ca = (a->bitmap & bit) ? a->children[index(a->bitmap, d)] : node_ptr();
+        node_ptr cb = (b->bitmap & bit) ? b->children[index(b->bitmap, d)] : node_ptr();
+        diff(ca, cb, shift + bits, f);
+      }
+      return;
+    }
+
+    // at least one side is a leaf, a collision node or empty: compare the
+    // leaves one by one
+    const node *an = a.get(), *bn = b.get();
+    auto changed = [&](const node *l) {
+      const node *o = find_leaf(bn, l->entry.first, l->hash, shift);
+      if (o != l)
+        f(l->entry.first, l->hash, &l->entry.second, o ? &o->entry.second : nullptr);
+    };
+    for_each_leaf(an, changed);
+    auto removed = [&](const node *l) {
+      if (!find_leaf(an, l->entry.first, l->hash, shift))
+        f(l->entry.first, l->hash, nullptr, &l->entry.second);
+    };
+    for_each_leaf(bn, removed);
+  }
+
+  node_ptr root_;
+  size_t size_;
+};
+
+// Three-way merge of maps: every key the joined revision changed against
+// the root snapshot is merged into the joiner's map with Merge. A key only
+// the joined revision has takes its value, and a key it erased is erased.
+template <class K, class V, class Merge>
+class map_merger {
+public:
+  hamt<K, V> operator()(const hamt<K, V> &main, const hamt<K, V> &join, const hamt<K, V> &root) const {
+    hamt<K, V> r = main;
+    join.diff(root, [&](const K &k, size_t h, const V *jv, const V *rv) {
+        if (!jv) {
+          r.erase(k, h);
+          return;
+        }
+        const V *mv = r.find(k, h);
+        if (mv)
+          r.set(k, mf_(*mv, *jv, rv ? *rv : zero()), h);
+        else
+          r.set(k, *jv, h);
+      });
+    return r;
+  }
+
+private:
+  static const V &zero() {
+    static const V z = V();
+    return z;
+  }
+
+  Merge mf_;
+};
+
+} // namespace detail
+
+// Versioned hash map with structural sharing.
+//
+// The map is a persistent trie, so forking costs nothing, the first write
+// in a segment copies only the path to the key, and join merges key by key
+// (see detail::map_merger) in time proportional to what the joined
+// revision changed.
+template <class K, class V, class Merge = default_merger<V>, class Hash = std::hash<K> >
+class versioned_map {
+  typedef detail::hamt<K, V> trie;
+  typedef detail::map_merger<K, V, Merge> merger;
+
+public:
+  size_t size() const {
+    return map().size();
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  // nullptr if k is not in the map; the value stays valid until this
+  // revision next writes the map
+  const V *find(const K &k) const {
+    return map().find(k, Hash()(k));
+  }
+
+  size_t count(const K &k) const {
+    return find(k) ? 1 : 0;
+  }
+
+  void set(const K &k, const V &v) {
+    t_.p_->local().set(k, v, Hash()(k));
+  }
+
+  void erase(const K &k) {
+    if (find(k))
+      t_.p_->local().erase(k, Hash()(k));
+  }
+
+  // calls f(key, value) for every entry, in no particular order
+  template <class F>
+  void for_each(F f) const {
+    map().for_each(f);
+  }
+
+private:
+  const trie &map() const {
+    return t_;
+  }
+
+  versioned<trie, merger> t_;
+};
+
+} // namespace concurrent_revisions